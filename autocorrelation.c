@@ -0,0 +1,128 @@
+/* Spike-time autocorrelation of single neurons, computed during the run.
+ *
+ * The autocorrelation averages, over the first AC_NEURONS neurons, the
+ * histogram of the lags between any two spikes of the same neuron less
+ * than AC_MAX_LAG apart, each spike with itself included. Rather than
+ * keeping their spike trains to the end of the run, each of these neurons
+ * keeps a ring of its spikes of the last AC_MAX_LAG ms. A new spike is
+ * paired with those in the ring, and the histogram updated, as soon as it
+ * is emitted, so the histogram is complete when the run ends.
+ *
+ * The pairs, and the lags computed for them, are those of a histogram
+ * built from the whole trains after the run, and the bin of each lag is
+ * the one gsl_histogram_increment would find: it is computed from the lag
+ * and then checked against the bounds of the bins, rather than searched
+ * for. The counts are whole numbers, so the order in which the pairs are
+ * added does not change the result either. */
+#include "autocorrelation.h"
+
+void start_autocorrelation(struct State *S)
+{
+        /* Set up an empty histogram and rings. A neuron spikes at most once
+         * per refractory period (and per time step), which gives the size
+         * of its ring; rings grow if need be. */
+        struct SpikeAutocorrelation *a = emalloc(sizeof(*a));
+        double interval = S->ntw.tau_rp > S->sim.DT ? S->ntw.tau_rp : S->sim.DT;
+
+        a->h = gsl_histogram_alloc(AC_BINS);
+        gsl_histogram_set_ranges_uniform(a->h, -AC_MAX_LAG, AC_MAX_LAG);
+        a->n_neurons = S->ntw.N < AC_NEURONS ? S->ntw.N : AC_NEURONS;
+        a->capacity = 0;
+        a->ring = NULL;
+        a->first = emalloc(a->n_neurons * sizeof(int));
+        a->count = emalloc(a->n_neurons * sizeof(int));
+        resize_autocorrelation(a, (int) (AC_MAX_LAG / interval) + 2);
+        clear_autocorrelation(a);
+        S->sim.autocorrelation = a;
+}
+
+void clear_autocorrelation(struct SpikeAutocorrelation *a)
+{
+        gsl_histogram_reset(a->h);
+        a->n_spikes = 0;
+        for (int i = 0; i < a->n_neurons; i++) {
+                a->first[i] = 0;
+                a->count[i] = 0;
+        }
+}
+
+void resize_autocorrelation(struct SpikeAutocorrelation *a, int capacity)
+{
+        /* Give every ring room for capacity spikes, keeping those it
+         * holds */
+        double *ring = emalloc((size_t) a->n_neurons * capacity * sizeof(double));
+
+        for (int i = 0; i < a->n_neurons; i++) {
+                for (int k = 0; k < a->count[i]; k++)
+                        ring[(size_t) i * capacity + k] =
+                                a->ring[(size_t) i * a->capacity + (a->first[i] + k) % a->capacity];
+                a->first[i] = 0;
+        }
+        free(a->ring);
+        a->ring = ring;
+        a->capacity = capacity;
+}
+
+static void add_lag(gsl_histogram *h, double x)
+{
+        /* Same as gsl_histogram_increment(h, x), for uniform bins */
+        const double *range = h->range;
+        size_t n = h->n;
+        size_t i;
+
+        if (!(x >= range[0] && x < range[n]))
+                return;
+        i = (size_t) ((x - range[0]) / (range[n] - range[0]) * n);
+        if (i >= n)
+                i = n - 1;
+        while (x < range[i])
+                i--;
+        while (x >= range[i + 1])
+                i++;
+        h->bin[i] += 1;
+}
+
+void autocorrelate_spike(struct SpikeAutocorrelation *a, int i, double t)
+{
+        /* Add the spike of neuron i at time t, which is later than all its
+         * previous ones */
+        double *ring = a->ring + (size_t) i * a->capacity;
+        double s;
+
+        /* Forget the spikes too old to pair with this one, or any later */
+        while (a->count[i] > 0) {
+                s = ring[a->first[i]];
+                if (s >= t - AC_MAX_LAG || t < s + AC_MAX_LAG)
+                        break;
+                a->first[i] = (a->first[i] + 1) % a->capacity;
+                a->count[i]--;
+        }
+        /* Pair it with the others, both ways, and with itself */
+        for (int k = 0; k < a->count[i]; k++) {
+                s = ring[(a->first[i] + k) % a->capacity];
+                if (s >= t - AC_MAX_LAG)
+                        add_lag(a->h, t - s);
+                if (t < s + AC_MAX_LAG)
+                        add_lag(a->h, s - t);
+        }
+        add_lag(a->h, t - t);
+        a->n_spikes++;
+
+        if (a->count[i] == a->capacity) {
+                resize_autocorrelation(a, 2 * a->capacity);
+                ring = a->ring + (size_t) i * a->capacity;
+        }
+        ring[(a->first[i] + a->count[i]) % a->capacity] = t;
+        a->count[i]++;
+}
+
+void free_autocorrelation(struct SpikeAutocorrelation *a)
+{
+        if (a == NULL)
+                return;
+        gsl_histogram_free(a->h);
+        free(a->ring);
+        free(a->first);
+        free(a->count);
+        free(a);
+}
@@ -0,0 +1,27 @@
+#ifndef _AUTOCORRELATION_H
+#define _AUTOCORRELATION_H 1
+
+#include "simulation.h"
+
+struct SpikeAutocorrelation {
+        /* Histogram of the lags between the spikes of each of the first
+         * n_neurons neurons, and how many spikes they emitted */
+        gsl_histogram *h;
+        uint64_t n_spikes;
+        int n_neurons;
+        /* The spikes of neuron i of the last AC_MAX_LAG ms, oldest first:
+         * ring[i * capacity + (first[i] + k) % capacity], for k = 0, ...,
+         * count[i] - 1 */
+        int capacity;
+        double *ring;
+        int *first;
+        int *count;
+};
+
+/* autocorrelation.c */
+void start_autocorrelation(struct State *S);
+void clear_autocorrelation(struct SpikeAutocorrelation *a);
+void resize_autocorrelation(struct SpikeAutocorrelation *a, int capacity);
+void autocorrelate_spike(struct SpikeAutocorrelation *a, int i, double t);
+void free_autocorrelation(struct SpikeAutocorrelation *a);
+#endif
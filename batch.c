@@ -0,0 +1,152 @@
+/* Batches of trials on the same network.
+ *
+ * Statistics of the dynamics need many trials, and for large networks
+ * building the connectivity takes longer than a trial. A batch builds the
+ * network once and runs n_trials trials on it. Trial k draws its initial
+ * conditions from substream k, so trial 0 is the same as a single run.
+ * The synaptic matrix is only read during a trial, so up to
+ * concurrent_trials trials run at once, each in a State of its own that
+ * shares the matrix (see clone_state).
+ *
+ * The outputs are averages over the trials, in the same files and formats
+ * as those of a single run: the population rates of every sampling window,
+ * and both autocorrelations. The mean rates of each trial are written to
+ * trial_rates_<suffix>. The sample of spikes and the synaptic variables at
+ * the end are those of trial 0. Trials are accumulated in order, so the
+ * results do not depend on how many of them run at once. */
+#include "batch.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+static inline int omp_get_thread_num(void) { return 0; }
+static inline void omp_set_max_active_levels(int n) { (void) n; }
+#endif
+
+struct TrialResults {
+        double rate_e;          /* mean rates after the offset (in Hz) */
+        double rate_i;
+        double ac[AC_BINS];
+        double global_ac[AC_BINS];
+};
+
+void run_batch(struct State *S, double *mean_e, double *mean_i)
+{
+        /* Run all the trials of the batch on the network of S, which must be
+         * built, write the averages, and return the mean rates over trials */
+        struct Simulation *sim = &S->sim;
+        int n_trials = sim->n_trials;
+        int n_workers = sim->concurrent_trials < n_trials ? sim->concurrent_trials : n_trials;
+        struct State *workers;
+        struct TrialResults *results;
+        double *rate_sum[3] = { NULL, NULL, NULL }; /* times, E and I rates */
+        size_t n_windows = 0;
+        double ac[AC_BINS], global_ac[AC_BINS];
+        double sum_e = 0, sum_e2 = 0, sum_i = 0, sum_i2 = 0;
+        char filename[MAX_FILENAME_LENGTH];
+        FILE *f;
+
+        snprintf(filename, sizeof(filename), "trial_rates_%s", sim->suffix);
+        if ((f = fopen(filename, "w")) == NULL)
+                eprintf("cannot open '%s':", filename);
+        fprintf(f, "# trial   rate E    rate I (Hz)\n");
+        for (int j = 0; j < AC_BINS; j++)
+                ac[j] = global_ac[j] = 0;
+
+        /* Thread 0 runs its trials on S itself, the others on clones */
+        sim->record_rates = true;
+        /* Trials report when they are done instead */
+        sim->show_progress = false;
+        for (int k = 0; k < 3; k++)
+                if (sim->rate_trace[k].data == NULL)
+                        init_dynamic_array(&sim->rate_trace[k]);
+        workers = emalloc(n_workers * sizeof(struct State));
+        results = emalloc(n_workers * sizeof(struct TrialResults));
+        for (int t = 1; t < n_workers; t++)
+                clone_state(&workers[t], S);
+        if (n_workers > 1 && sim->n_threads > 1)
+                omp_set_max_active_levels(2);
+        if (sim->verbose)
+                report("Running %d trials, %d at a time.\n", n_trials, n_workers);
+
+#pragma omp parallel num_threads(n_workers)
+        {
+                int t = omp_get_thread_num();
+                struct State *W = t == 0 ? S : &workers[t];
+                struct TrialResults *res = &results[t];
+                struct Dynamic_Array *trace = W->sim.rate_trace;
+                FILE *spikes_file;
+
+#pragma omp for schedule(dynamic, 1) ordered
+                for (int k = 0; k < n_trials; k++) {
+                        reset(W, k);
+                        run_trial(W);
+                        mean_rates(W, &res->rate_e, &res->rate_i);
+                        average_autocorrelation(W, res->ac);
+                        global_autocorrelation(W, res->global_ac);
+#pragma omp ordered
+                        {
+                                if (k == 0) {
+                                        n_windows = trace[0].n;
+                                        for (int c = 0; c < 3; c++) {
+                                                rate_sum[c] = emalloc(n_windows * sizeof(double));
+                                                for (size_t w = 0; w < n_windows; w++)
+                                                        rate_sum[c][w] = 0;
+                                        }
+                                        memcpy(rate_sum[0], trace[0].data, n_windows * sizeof(double));
+                                        spikes_file = W->sim.spikes_file;
+                                        W->sim.spikes_file = sim->spikes_file;
+                                        save_spike_activity(W);
+                                        W->sim.spikes_file = spikes_file;
+                                        save_final_state(W);
+                                } else if (trace[0].n != n_windows) {
+                                        eprintf("trial %d sampled %zu windows instead of %zu\n",
+                                                        k, trace[0].n, n_windows);
+                                }
+                                for (int c = 1; c < 3; c++)
+                                        for (size_t w = 0; w < n_windows; w++)
+                                                rate_sum[c][w] += trace[c].data[w];
+                                for (int j = 0; j < AC_BINS; j++) {
+                                        ac[j] += res->ac[j];
+                                        global_ac[j] += res->global_ac[j];
+                                }
+                                sum_e += res->rate_e;
+                                sum_e2 += res->rate_e * res->rate_e;
+                                sum_i += res->rate_i;
+                                sum_i2 += res->rate_i * res->rate_i;
+                                fprintf(f, "% 7d % 9.3f % 9.3f\n", k, res->rate_e, res->rate_i);
+                                fflush(f);
+                                report("Trial %d of %d done: % 7.3f Hz (E), % 7.3f Hz (I)\n",
+                                                k + 1, n_trials, res->rate_e, res->rate_i);
+                        }
+                }
+        }
+        fclose(f);
+
+        /* Averages over trials */
+        for (size_t w = 0; w < n_windows; w++) {
+                fprintf(sim->pop_rates_file, "% 9.3f  ", rate_sum[0][w]);
+                fprintf(sim->pop_rates_file, "% 9.3f % 9.3f\n",
+                                rate_sum[1][w] / n_trials, rate_sum[2][w] / n_trials);
+        }
+        for (int j = 0; j < AC_BINS; j++) {
+                ac[j] /= n_trials;
+                global_ac[j] /= n_trials;
+        }
+        snprintf(filename, sizeof(filename), "autocorrelation_%s", sim->suffix);
+        write_autocorrelation(filename, AC_MAX_LAG, ac, 7);
+        snprintf(filename, sizeof(filename), "global_autocorrelation_%s", sim->suffix);
+        write_autocorrelation(filename, GLOBAL_AC_MAX_LAG, global_ac, 6);
+        *mean_e = sum_e / n_trials;
+        *mean_i = sum_i / n_trials;
+        report("Mean rates over %d trials: %.3f +- %.3f Hz (E), %.3f +- %.3f Hz (I)\n",
+                        n_trials, *mean_e, sqrt(fmax(sum_e2 / n_trials - *mean_e * *mean_e, 0)),
+                        *mean_i, sqrt(fmax(sum_i2 / n_trials - *mean_i * *mean_i, 0)));
+
+        for (int c = 0; c < 3; c++)
+                free(rate_sum[c]);
+        for (int t = 1; t < n_workers; t++)
+                free_state(&workers[t]);
+        free(workers);
+        free(results);
+}
@@ -0,0 +1,8 @@
+#ifndef _BATCH_H
+#define _BATCH_H 1
+
+#include "simulation.h"
+
+/* batch.c */
+void run_batch(struct State *S, double *mean_e, double *mean_i);
+#endif
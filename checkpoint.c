@@ -0,0 +1,409 @@
+/* Checkpoints of a running simulation, and restart from them.
+ *
+ * A checkpoint holds everything that evolves during a run: the state of the
+ * neurons, the table of spikes with its pivots, the spike counters, the
+ * history of spikes, the autocorrelation built so far, the time, and how
+ * much of the population rate file and of the spike record had been
+ * written. The connectivity is not saved: it is a function of the seed,
+ * and is rebuilt (or mapped from the connectivity file) on restart. There
+ * is no random number generator state to save either, since all streams
+ * are counter-based and used only during construction.
+ *
+ * Saving does not stall the step loop for long: the state is copied into a
+ * single buffer, and a background thread writes the buffer to disk while
+ * the simulation goes on. The file is written under a temporary name and
+ * renamed when complete, so a crash while writing leaves the previous
+ * checkpoint intact. Checkpoints are only taken right after the population
+ * rate has been flushed, so that a restarted run resumes at the same point
+ * of the sampling window. */
+#include <pthread.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "ratewriter.h"
+#include "autocorrelation.h"
+#include "spikelog.h"
+
+struct CheckpointHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t N;
+        int32_t NE;
+        int32_t C;
+        int32_t sampling;
+        int32_t connectivity;
+        int32_t table_size;
+        int32_t i_curr;
+        int32_t i_delay;
+        int32_t ne_spikes;
+        int32_t ni_spikes;
+        int32_t real_size;      /* precision of the neuron state */
+        int32_t integrator;
+        int32_t slow_flag;
+        uint64_t seed;
+        double DT;
+        /* The parameters of the dynamics, which a restart must not change */
+        double J;
+        double g;
+        double ext_current;
+        double tau_m;
+        double tau_rp;
+        double tau_fast;
+        double tau_slow;
+        double delay;
+        double time;
+        int64_t pop_rates_offset;
+        int64_t spike_log_offset;       /* -1 without a spike record */
+        uint64_t size;          /* bytes that follow the header */
+        uint64_t checksum;      /* of the header (with this field 0) and the rest */
+};
+
+static const char checkpoint_magic[8] = "LIFCKPT";
+#define CHECKPOINT_VERSION 7
+
+struct CheckpointJob {
+        char path[MAX_PATH_LENGTH];
+        char *buffer;
+        size_t size;
+};
+
+static void put(char **p, const void *src, size_t n)
+{
+        memcpy(*p, src, n);
+        *p += n;
+}
+
+static bool get(const char **p, const char *end, void *dst, size_t n)
+{
+        /* Take n bytes, unless fewer are left */
+        if (n > (size_t) (end - *p))
+                return false;
+        memcpy(dst, *p, n);
+        *p += n;
+        return true;
+}
+
+static bool all_within(const int *v, size_t n, int lo, int hi)
+{
+        /* Whether lo <= v[k] < hi for all k */
+        for (size_t k = 0; k < n; k++)
+                if (v[k] < lo || v[k] >= hi)
+                        return false;
+        return true;
+}
+
+static void *write_checkpoint(void *arg)
+{
+        struct CheckpointJob *job = arg;
+        char tmp[MAX_PATH_LENGTH + 8];
+        uint64_t checksum;
+        FILE *f;
+        int ok;
+
+        /* The header in the buffer holds a checksum of 0 until now */
+        checksum = fnv_checksum(job->buffer, job->size, 0xcbf29ce484222325ULL);
+        memcpy(job->buffer + offsetof(struct CheckpointHeader, checksum), &checksum,
+                        sizeof(checksum));
+        snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+        if ((f = fopen(tmp, "wb")) == NULL) {
+                weprintf("cannot write checkpoint '%s':", tmp);
+        } else {
+                ok = fwrite(job->buffer, 1, job->size, f) == job->size
+                        && fflush(f) == 0 && fsync(fileno(f)) == 0;
+                ok = (fclose(f) == 0) && ok;
+                if (!ok || rename(tmp, job->path) != 0) {
+                        weprintf("cannot write checkpoint '%s':", job->path);
+                        remove(tmp);
+                }
+        }
+        free(job->buffer);
+        free(job);
+        return NULL;
+}
+
+static void fill_header(const struct State *S, struct CheckpointHeader *h)
+{
+        const struct Network *ntw = &S->ntw;
+
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, checkpoint_magic, sizeof(h->magic));
+        h->version = CHECKPOINT_VERSION;
+        h->N = ntw->N;
+        h->NE = ntw->NE;
+        h->C = ntw->C;
+        h->sampling = ntw->sampling;
+        h->connectivity = ntw->connectivity;
+        h->table_size = ntw->tab_spikes.size;
+        h->seed = ntw->seed;
+        h->DT = S->sim.DT;
+        h->real_size = sizeof(real);
+        h->integrator = S->sim.integrator;
+        h->slow_flag = ntw->slow_flag;
+        h->J = ntw->J;
+        h->g = ntw->g;
+        h->ext_current = ntw->ext_current;
+        h->tau_m = ntw->tau_m;
+        h->tau_rp = ntw->tau_rp;
+        h->tau_fast = ntw->tau_fast;
+        h->tau_slow = ntw->tau_slow;
+        h->delay = ntw->delay;
+}
+
+void save_checkpoint(struct State *S)
+{
+        /* Copy the state into a buffer and hand it to a writer thread */
+        struct Simulation *sim = &S->sim;
+        struct Network *ntw = &S->ntw;
+        struct TableNSpikes *t = &ntw->tab_spikes;
+        struct CheckpointHeader h;
+        struct CheckpointJob *job;
+        struct SpikeHistory *hist = &ntw->history;
+        struct SpikeAutocorrelation *ac = sim->autocorrelation;
+        size_t size, n;
+        char *p;
+        int N = ntw->N;
+
+        /* Only one checkpoint is written at a time */
+        finish_checkpoints(S);
+
+        flush_rate_writer(S);
+        fill_header(S, &h);
+        h.i_curr = t->i_curr;
+        h.i_delay = t->i_delay;
+        h.ne_spikes = ntw->ne_spikes;
+        h.ni_spikes = ntw->ni_spikes;
+        h.time = sim->time;
+        h.pop_rates_offset = ftell(sim->pop_rates_file);
+        h.spike_log_offset = flush_spike_log(S);
+
+        size = (size_t) N * (3 * sizeof(real) + sizeof(int) + sizeof(unsigned))
+                + (size_t) t->size * sizeof(int);
+        for (int i = 0; i < t->size; i++)
+                size += t->num_spikes[i] * sizeof(int);
+        size += sizeof(size_t) + hist->n * sizeof(struct SpikeEvent);
+        size += sizeof(uint64_t) + AC_BINS * sizeof(double) + sizeof(int)
+                + 2 * ac->n_neurons * sizeof(int)
+                + (size_t) ac->n_neurons * ac->capacity * sizeof(double);
+        h.size = size;
+
+        job = emalloc(sizeof(*job));
+        snprintf(job->path, MAX_PATH_LENGTH, "%s", sim->checkpoint_file);
+        job->size = sizeof(h) + size;
+        job->buffer = emalloc(job->size);
+
+        p = job->buffer;
+        put(&p, &h, sizeof(h));
+        put(&p, ntw->cell.V_m, N * sizeof(real));
+        put(&p, ntw->cell.I_fast, N * sizeof(real));
+        put(&p, ntw->cell.I_slow, N * sizeof(real));
+        put(&p, ntw->cell.ref_state, N * sizeof(int));
+        put(&p, ntw->spike_count, N * sizeof(unsigned));
+        put(&p, t->num_spikes, t->size * sizeof(int));
+        for (int i = 0; i < t->size; i++)
+                put(&p, t->indices[i], t->num_spikes[i] * sizeof(int));
+        put(&p, &hist->n, sizeof(size_t));
+        for (size_t k = 0; k < hist->n; k += n) {
+                n = hist->n - k < HISTORY_CHUNK ? hist->n - k : HISTORY_CHUNK;
+                put(&p, hist->chunk[k / HISTORY_CHUNK], n * sizeof(struct SpikeEvent));
+        }
+        put(&p, &ac->n_spikes, sizeof(uint64_t));
+        put(&p, ac->h->bin, AC_BINS * sizeof(double));
+        put(&p, &ac->capacity, sizeof(int));
+        put(&p, ac->first, ac->n_neurons * sizeof(int));
+        put(&p, ac->count, ac->n_neurons * sizeof(int));
+        put(&p, ac->ring, (size_t) ac->n_neurons * ac->capacity * sizeof(double));
+
+        if (pthread_create(&sim->checkpoint_writer, NULL, write_checkpoint, job) != 0) {
+                /* No thread: write it here */
+                write_checkpoint(job);
+                return;
+        }
+        sim->checkpoint_pending = true;
+        if (sim->verbose)
+                report("\nCheckpoint at t = %.3f ms (%zu bytes).\n", sim->time,
+                                sizeof(h) + size);
+}
+
+void checkpoint_if_due(struct State *S)
+{
+        struct Simulation *sim = &S->sim;
+
+        if (sim->checkpoint_file[0] == '\0' || sim->checkpoint_interval <= 0)
+                return;
+        if (sim->time + 0.5 * sim->DT < sim->next_checkpoint)
+                return;
+        save_checkpoint(S);
+        while (sim->next_checkpoint <= sim->time + 0.5 * sim->DT)
+                sim->next_checkpoint += sim->checkpoint_interval;
+}
+
+void finish_checkpoints(struct State *S)
+{
+        /* Wait until the checkpoint being written, if any, is on disk */
+        if (S->sim.checkpoint_pending) {
+                pthread_join(S->sim.checkpoint_writer, NULL);
+                S->sim.checkpoint_pending = false;
+        }
+}
+
+int restore_checkpoint(struct State *S, const char *path)
+{
+        /* Resume from the checkpoint in path. The network must already be
+         * built with the same parameters, and the output files open. The
+         * file is checked whole, and every count and neuron in it against
+         * the network, before it is used. Returns 0 on success. */
+        struct Simulation *sim = &S->sim;
+        struct Network *ntw = &S->ntw;
+        struct TableNSpikes *t = &ntw->tab_spikes;
+        struct CheckpointHeader h, expected;
+        struct SpikeAutocorrelation *ac = sim->autocorrelation;
+        struct SpikeEvent e;
+        char *buffer;
+        const char *p, *end;
+        int *num_spikes;
+        FILE *f;
+        int N = ntw->N;
+        int max_spikes = 0;
+        size_t n_events, n_ring;
+        uint64_t checksum;
+        int capacity;
+        long length;
+        bool ok;
+
+        if ((f = fopen(path, "rb")) == NULL) {
+                weprintf("cannot open checkpoint '%s':", path);
+                return -1;
+        }
+        if (fread(&h, sizeof(h), 1, f) != 1) {
+                report("'%s' is not a checkpoint.\n", path);
+                fclose(f);
+                return -1;
+        }
+        fill_header(S, &expected);
+        if (memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0
+                        || h.version != expected.version
+                        || h.N != expected.N || h.NE != expected.NE
+                        || h.C != expected.C || h.sampling != expected.sampling
+                        || h.connectivity != expected.connectivity
+                        || h.table_size != expected.table_size
+                        || h.seed != expected.seed || h.DT != expected.DT
+                        || h.real_size != expected.real_size) {
+                report("'%s' was saved from a different network.\n", path);
+                fclose(f);
+                return -1;
+        }
+        if (h.integrator != expected.integrator || h.slow_flag != expected.slow_flag
+                        || h.J != expected.J || h.g != expected.g
+                        || h.ext_current != expected.ext_current
+                        || h.tau_m != expected.tau_m || h.tau_rp != expected.tau_rp
+                        || h.tau_fast != expected.tau_fast
+                        || h.tau_slow != expected.tau_slow
+                        || h.delay != expected.delay) {
+                report("'%s' was saved with other parameters of the dynamics.\n", path);
+                fclose(f);
+                return -1;
+        }
+        if (fseek(f, 0, SEEK_END) != 0 || (length = ftell(f)) < 0
+                        || h.size != (uint64_t) length - sizeof(h)) {
+                report("'%s' is truncated.\n", path);
+                fclose(f);
+                return -1;
+        }
+        buffer = emalloc(h.size > 0 ? h.size : 1);
+        if (fseek(f, sizeof(h), SEEK_SET) != 0 || fread(buffer, 1, h.size, f) != h.size) {
+                report("'%s' is truncated.\n", path);
+                free(buffer);
+                fclose(f);
+                return -1;
+        }
+        fclose(f);
+        checksum = h.checksum;
+        h.checksum = 0;
+        if (fnv_checksum(buffer, h.size, fnv_checksum(&h, sizeof(h), 0xcbf29ce484222325ULL))
+                        != checksum) {
+                report("'%s' is corrupt.\n", path);
+                free(buffer);
+                return -1;
+        }
+
+        p = buffer;
+        end = buffer + h.size;
+        ok = h.i_curr >= 0 && h.i_curr < t->size && h.i_delay >= 0 && h.i_delay < t->size
+                && h.ne_spikes >= 0 && h.ni_spikes >= 0 && h.pop_rates_offset >= 0
+                && h.spike_log_offset >= -1
+                && get(&p, end, ntw->cell.V_m, N * sizeof(real))
+                && get(&p, end, ntw->cell.I_fast, N * sizeof(real))
+                && get(&p, end, ntw->cell.I_slow, N * sizeof(real))
+                && get(&p, end, ntw->cell.ref_state, N * sizeof(int))
+                && get(&p, end, ntw->spike_count, N * sizeof(unsigned));
+        /* The table is still empty, so it can grow before it is filled. It
+         * never holds more than N spikes per slot. */
+        num_spikes = emalloc(t->size * sizeof(int));
+        ok = ok && get(&p, end, num_spikes, t->size * sizeof(int))
+                && all_within(num_spikes, t->size, 0, N + 1);
+        if (ok) {
+                for (int i = 0; i < t->size; i++)
+                        if (num_spikes[i] > max_spikes)
+                                max_spikes = num_spikes[i];
+                if (max_spikes > t->capacity)
+                        grow_table_of_spikes(t, max_spikes, N);
+                memcpy(t->num_spikes, num_spikes, t->size * sizeof(int));
+        }
+        free(num_spikes);
+        for (int i = 0; ok && i < t->size; i++)
+                ok = get(&p, end, t->indices[i], t->num_spikes[i] * sizeof(int))
+                        && all_within(t->indices[i], t->num_spikes[i], 0, N);
+        t->i_curr = h.i_curr;
+        t->i_delay = h.i_delay;
+        clear_history(&ntw->history);
+        ok = ok && get(&p, end, &n_events, sizeof(size_t));
+        for (size_t k = 0; ok && k < n_events; k++) {
+                ok = get(&p, end, &e, sizeof(e)) && e.id >= 0 && e.id < N;
+                if (ok)
+                        record_spike(&ntw->history, e.id, e.time);
+        }
+        ok = ok && get(&p, end, &ac->n_spikes, sizeof(uint64_t))
+                && get(&p, end, ac->h->bin, AC_BINS * sizeof(double))
+                && get(&p, end, &capacity, sizeof(int)) && capacity > 0
+                && get(&p, end, ac->first, ac->n_neurons * sizeof(int))
+                && get(&p, end, ac->count, ac->n_neurons * sizeof(int))
+                && all_within(ac->first, ac->n_neurons, 0, capacity)
+                && all_within(ac->count, ac->n_neurons, 0, capacity + 1);
+        /* The rings are all that is left */
+        n_ring = ok ? (size_t) (end - p) / sizeof(double) : 0;
+        ok = ok && (size_t) (end - p) % sizeof(double) == 0
+                && n_ring == (size_t) ac->n_neurons * capacity;
+        if (ok && capacity != ac->capacity) {
+                free(ac->ring);
+                ac->ring = emalloc(n_ring * sizeof(double));
+                ac->capacity = capacity;
+        }
+        ok = ok && get(&p, end, ac->ring, n_ring * sizeof(double)) && p == end;
+        free(buffer);
+        if (!ok) {
+                report("'%s' is corrupt.\n", path);
+                return -1;
+        }
+
+        ntw->ne_spikes = h.ne_spikes;
+        ntw->ni_spikes = h.ni_spikes;
+        sim->time = h.time;
+        sim->next_checkpoint = sim->time + sim->checkpoint_interval;
+        sim->spike_log_offset = h.spike_log_offset;
+
+        /* Drop the population rates written after the checkpoint */
+        fflush(sim->pop_rates_file);
+        fseek(sim->pop_rates_file, 0, SEEK_END);
+        length = ftell(sim->pop_rates_file);
+        if (length < h.pop_rates_offset) {
+                report("The population rate file is shorter than at the checkpoint; "
+                                "rates up to t = %.3f ms are missing.\n", sim->time);
+        } else {
+                if (ftruncate(fileno(sim->pop_rates_file), h.pop_rates_offset) != 0)
+                        weprintf("cannot truncate the population rate file:");
+                fseek(sim->pop_rates_file, h.pop_rates_offset, SEEK_SET);
+        }
+        if (sim->verbose)
+                report("Restarted from '%s' at t = %.3f ms.\n", path, sim->time);
+        return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H 1
+
+#include "simulation.h"
+
+/* checkpoint.c */
+void save_checkpoint(struct State *S);
+void checkpoint_if_due(struct State *S);
+void finish_checkpoints(struct State *S);
+int restore_checkpoint(struct State *S, const char *path);
+#endif
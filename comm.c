@@ -0,0 +1,208 @@
+/* Processes of a distributed run, and messages between them.
+ *
+ * comm_init forks size - 1 copies of the calling process, which must not
+ * have started any thread yet. Rank 0 (the original process) holds one end
+ * of a socket pair for every other rank, and every other rank the other
+ * end. Messages are a length followed by the bytes; collective operations
+ * go through rank 0, which receives from all ranks in order and then sends
+ * to all of them, so no two ranks ever wait for each other. If a process
+ * dies, its peer sees the socket close and exits as well. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "comm.h"
+#include "eprintf.h"
+
+void comm_init(struct Comm *c, int size)
+{
+        int sv[2];
+        pid_t pid;
+
+        c->rank = 0;
+        c->size = size < 1 ? 1 : size;
+        c->fd = emalloc(c->size * sizeof(int));
+        c->pid = emalloc(c->size * sizeof(pid_t));
+        /* Output still buffered would be written by every process */
+        fflush(NULL);
+        for (int r = 1; r < c->size; r++) {
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+                        eprintf("cannot create a socket pair:");
+                if ((pid = fork()) < 0)
+                        eprintf("cannot start process %d:", r);
+                if (pid == 0) {
+                        /* Rank r keeps its end only */
+                        for (int q = 1; q < r; q++)
+                                close(c->fd[q]);
+                        close(sv[0]);
+                        c->rank = r;
+                        c->fd[0] = sv[1];
+                        return;
+                }
+                close(sv[1]);
+                c->fd[r] = sv[0];
+                c->pid[r] = pid;
+        }
+}
+
+int comm_finalize(struct Comm *c, int status)
+{
+        /* Close the connections. Rank 0 waits for the other ranks, and
+         * returns nonzero if any of them failed. */
+        int s;
+
+        if (c->rank == 0) {
+                for (int r = 1; r < c->size; r++)
+                        close(c->fd[r]);
+                for (int r = 1; r < c->size; r++) {
+                        if (waitpid(c->pid[r], &s, 0) < 0 || !WIFEXITED(s)
+                                        || WEXITSTATUS(s) != 0) {
+                                report("Process %d failed.\n", r);
+                                status = 1;
+                        }
+                }
+        } else if (c->size > 1) {
+                close(c->fd[0]);
+        }
+        free(c->fd);
+        free(c->pid);
+        return status;
+}
+
+static void write_all(int fd, const void *buf, size_t n)
+{
+        const char *p = buf;
+        ssize_t k;
+
+        while (n > 0) {
+                k = write(fd, p, n);
+                if (k < 0 && errno == EINTR)
+                        continue;
+                if (k <= 0)
+                        eprintf("lost the connection to another process:");
+                p += k;
+                n -= k;
+        }
+}
+
+static void read_all(int fd, void *buf, size_t n)
+{
+        char *p = buf;
+        ssize_t k;
+
+        while (n > 0) {
+                k = read(fd, p, n);
+                if (k < 0 && errno == EINTR)
+                        continue;
+                if (k == 0)
+                        eprintf("another process exited\n");
+                if (k < 0)
+                        eprintf("lost the connection to another process:");
+                p += k;
+                n -= k;
+        }
+}
+
+static int peer(const struct Comm *c, int r)
+{
+        if (c->rank != 0 && r != 0)
+                eprintf("rank %d cannot talk to rank %d directly\n", c->rank, r);
+        return c->rank == 0 ? c->fd[r] : c->fd[0];
+}
+
+void comm_send(struct Comm *c, int to, const void *buf, size_t n)
+{
+        uint64_t len = n;
+        int fd = peer(c, to);
+
+        write_all(fd, &len, sizeof(len));
+        write_all(fd, buf, n);
+}
+
+void *comm_recv(struct Comm *c, int from, size_t *n)
+{
+        /* Receive the next message from rank from, in a buffer that the
+         * caller frees */
+        uint64_t len;
+        int fd = peer(c, from);
+        void *buf;
+
+        read_all(fd, &len, sizeof(len));
+        buf = emalloc(len > 0 ? len : 1);
+        read_all(fd, buf, len);
+        *n = len;
+        return buf;
+}
+
+void *comm_gather(struct Comm *c, const void *buf, size_t n, size_t *sizes)
+{
+        /* Concatenate the buffers of all ranks, in rank order, on rank 0,
+         * which gets the size of each in sizes. Returns the concatenation on
+         * rank 0 (to be freed by the caller), NULL elsewhere. */
+        void **part;
+        char *all, *p;
+        size_t total = n;
+
+        if (c->rank != 0) {
+                comm_send(c, 0, buf, n);
+                return NULL;
+        }
+        part = emalloc(c->size * sizeof(void *));
+        sizes[0] = n;
+        for (int r = 1; r < c->size; r++) {
+                part[r] = comm_recv(c, r, &sizes[r]);
+                total += sizes[r];
+        }
+        p = all = emalloc(total > 0 ? total : 1);
+        memcpy(p, buf, n);
+        p += n;
+        for (int r = 1; r < c->size; r++) {
+                memcpy(p, part[r], sizes[r]);
+                p += sizes[r];
+                free(part[r]);
+        }
+        free(part);
+        return all;
+}
+
+void *comm_allgather(struct Comm *c, const void *buf, size_t n, size_t *sizes)
+{
+        /* Same as comm_gather, but every rank gets the concatenation and
+         * the sizes */
+        uint64_t *len;
+        char *all;
+        size_t total = 0, k;
+
+        all = comm_gather(c, buf, n, sizes);
+        len = emalloc(c->size * sizeof(uint64_t));
+        if (c->rank == 0) {
+                for (int r = 0; r < c->size; r++) {
+                        len[r] = sizes[r];
+                        total += sizes[r];
+                }
+                for (int r = 1; r < c->size; r++) {
+                        comm_send(c, r, len, c->size * sizeof(uint64_t));
+                        comm_send(c, r, all, total);
+                }
+        } else {
+                free(len);
+                len = comm_recv(c, 0, &k);
+                for (int r = 0; r < c->size; r++)
+                        sizes[r] = len[r];
+                all = comm_recv(c, 0, &k);
+        }
+        free(len);
+        return all;
+}
+
+void comm_barrier(struct Comm *c)
+{
+        size_t *sizes = emalloc(c->size * sizeof(size_t));
+
+        free(comm_allgather(c, NULL, 0, sizes));
+        free(sizes);
+}
@@ -0,0 +1,27 @@
+#ifndef _COMM_H
+#define _COMM_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Communication between the processes of a distributed run. The interface
+ * is the small subset of MPI that the simulation needs (ranks, messages
+ * between two ranks, gather, allgather and barrier), so that it can be
+ * mapped onto MPI later. This implementation forks all the processes on one
+ * machine and connects every rank to rank 0 with a socket pair. */
+struct Comm {
+        int rank;
+        int size;
+        int *fd;        /* on rank 0, fd[r] leads to rank r; elsewhere fd[0] */
+        pid_t *pid;     /* on rank 0, the processes of the other ranks */
+};
+
+/* comm.c */
+void comm_init(struct Comm *c, int size);
+int comm_finalize(struct Comm *c, int status);
+void comm_send(struct Comm *c, int to, const void *buf, size_t n);
+void *comm_recv(struct Comm *c, int from, size_t *n);
+void *comm_gather(struct Comm *c, const void *buf, size_t n, size_t *sizes);
+void *comm_allgather(struct Comm *c, const void *buf, size_t n, size_t *sizes);
+void comm_barrier(struct Comm *c);
+#endif
@@ -0,0 +1,121 @@
+/* Compare two output files of simulate_one_trial column by column, e.g. the
+ * population rates or autocorrelations of the same network simulated in
+ * double and in single precision.
+ *
+ * The dynamics of the network are chaotic, so two runs that differ only in
+ * rounding diverge spike by spike after a short while; what must agree are
+ * the statistics. For every column but the first (time or lag), this reports
+ * the mean and standard deviation in both files and the relative difference
+ * of the means, plus the RMS difference between the two columns relative to
+ * the RMS of the first one, which is small for curves like autocorrelations
+ * but not for time series of rates.
+ *
+ * Usage: compare_trials FILE_A FILE_B */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "eprintf.h"
+
+#define MAX_COLUMNS 16
+
+struct Table {
+        int n_rows;
+        int n_columns;
+        double *data;   /* n_rows * n_columns, row by row */
+};
+
+static void read_table(const char *path, struct Table *t)
+{
+        FILE *f;
+        char line[4096];
+        char *p, *q;
+        double row[MAX_COLUMNS];
+        int n, size = 1024;
+
+        if ((f = fopen(path, "r")) == NULL)
+                eprintf("cannot open '%s':", path);
+        t->n_rows = 0;
+        t->n_columns = 0;
+        t->data = emalloc(size * MAX_COLUMNS * sizeof(double));
+        while (fgets(line, sizeof(line), f) != NULL) {
+                if (line[0] == '#')
+                        continue;
+                n = 0;
+                p = line;
+                while (n < MAX_COLUMNS) {
+                        row[n] = strtod(p, &q);
+                        if (q == p)
+                                break;
+                        p = q;
+                        n++;
+                }
+                if (n == 0)
+                        continue;
+                if (t->n_columns == 0)
+                        t->n_columns = n;
+                else if (n != t->n_columns)
+                        eprintf("'%s': line %d has %d columns instead of %d\n",
+                                        path, t->n_rows + 1, n, t->n_columns);
+                if (t->n_rows == size) {
+                        size *= 2;
+                        t->data = erealloc(t->data, size * MAX_COLUMNS * sizeof(double));
+                }
+                memcpy(t->data + (size_t) t->n_rows * t->n_columns, row,
+                                n * sizeof(double));
+                t->n_rows++;
+        }
+        fclose(f);
+}
+
+static void moments(const struct Table *t, int c, double *mean, double *sd)
+{
+        double s = 0, s2 = 0, x;
+
+        for (int i = 0; i < t->n_rows; i++) {
+                x = t->data[(size_t) i * t->n_columns + c];
+                s += x;
+                s2 += x * x;
+        }
+        *mean = s / t->n_rows;
+        *sd = sqrt(fmax(s2 / t->n_rows - *mean * *mean, 0));
+}
+
+int main(int argc, char *argv[])
+{
+        struct Table a, b;
+        double mean_a, mean_b, sd_a, sd_b, d, diff2, norm2, x;
+
+        setprogname("compare_trials");
+        if (argc != 3) {
+                fprintf(stderr, "Usage: %s FILE_A FILE_B\n", argv[0]);
+                return 2;
+        }
+        read_table(argv[1], &a);
+        read_table(argv[2], &b);
+        if (a.n_columns != b.n_columns || a.n_rows != b.n_rows || a.n_rows == 0)
+                eprintf("'%s' (%d x %d) and '%s' (%d x %d) cannot be compared\n",
+                                argv[1], a.n_rows, a.n_columns,
+                                argv[2], b.n_rows, b.n_columns);
+
+        printf("%s\n", argv[1]);
+        printf("  column      mean A      mean B   rel. diff        sd A        sd B   rms diff/rms A\n");
+        for (int c = 1; c < a.n_columns; c++) {
+                moments(&a, c, &mean_a, &sd_a);
+                moments(&b, c, &mean_b, &sd_b);
+                diff2 = norm2 = 0;
+                for (int i = 0; i < a.n_rows; i++) {
+                        x = a.data[(size_t) i * a.n_columns + c];
+                        d = x - b.data[(size_t) i * b.n_columns + c];
+                        diff2 += d * d;
+                        norm2 += x * x;
+                }
+                printf("  %6d % 11.5g % 11.5g % 10.3f%% % 11.5g % 11.5g % 16.3e\n",
+                                c + 1, mean_a, mean_b,
+                                mean_a != 0 ? 100 * (mean_b - mean_a) / fabs(mean_a) : 0.0,
+                                sd_a, sd_b, norm2 > 0 ? sqrt(diff2 / norm2) : sqrt(diff2));
+        }
+        free(a.data);
+        free(b.data);
+        return 0;
+}
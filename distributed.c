@@ -0,0 +1,268 @@
+/* A network distributed over several processes.
+ *
+ * Each process (rank) holds a contiguous range of neurons, their state and
+ * the synapses onto them (see set_local_range), and integrates them on its
+ * own threads. A spike reaches its targets only lag time steps after it is
+ * emitted, so the processes need not hear of each other's spikes at every
+ * step: they simulate lag steps on their own, then exchange the spikes of
+ * those steps all at once, before any of them is due. The exchanged spikes
+ * fill the same slots of the table of spikes, in the same order (by neuron
+ * index), as in a single process, so the run gives the same results
+ * whatever the number of processes.
+ *
+ * Rank 0 writes all the outputs. It receives the spike counts of every
+ * step along with the spikes, for the population rates, and at the end the
+ * history of spikes of the analyzed neurons (see keeps_train) and the
+ * autocorrelation histograms. The final state is written by every rank in
+ * turn. */
+#include <sys/resource.h>
+#include "distributed.h"
+#include "ratewriter.h"
+#include "spikearchive.h"
+#include "autocorrelation.h"
+
+struct Window {
+        /* Steps simulated since the last exchange: their slots in the table
+         * of spikes, the time at their end, and the spikes counted in them
+         * (after the offset) by this process */
+        int n;
+        int *slot;
+        double *time;
+        int *ne_spikes;
+        int *ni_spikes;
+};
+
+static int *pack_window(struct State *S, struct Window *w, size_t *n)
+{
+        /* For each step of the window, the spike counts, the number of
+         * spikes and the neurons that fired */
+        struct TableNSpikes *t = &S->ntw.tab_spikes;
+        int *buf, *p;
+        size_t size = 0;
+
+        for (int k = 0; k < w->n; k++)
+                size += 3 + t->num_spikes[w->slot[k]];
+        p = buf = emalloc(size * sizeof(int));
+        for (int k = 0; k < w->n; k++) {
+                *p++ = w->ne_spikes[k];
+                *p++ = w->ni_spikes[k];
+                *p++ = t->num_spikes[w->slot[k]];
+                memcpy(p, t->indices[w->slot[k]], t->num_spikes[w->slot[k]] * sizeof(int));
+                p += t->num_spikes[w->slot[k]];
+        }
+        *n = size * sizeof(int);
+        return buf;
+}
+
+static void exchange_spikes(struct State *S, struct Comm *c, struct Window *w,
+                int *ne_global, int *ni_global)
+{
+        /* Replace the local spikes of every step of the window with those
+         * of all processes, concatenated in rank order, and add up the
+         * spike counts of each step */
+        struct TableNSpikes *t = &S->ntw.tab_spikes;
+        size_t n, *sizes;
+        int *buf, *all, **part;
+        int slot, total;
+
+        buf = pack_window(S, w, &n);
+        sizes = emalloc(c->size * sizeof(size_t));
+        part = emalloc(c->size * sizeof(int *));
+        all = comm_allgather(c, buf, n, sizes);
+        part[0] = all;
+        for (int r = 1; r < c->size; r++)
+                part[r] = part[r - 1] + sizes[r - 1] / sizeof(int);
+
+        for (int k = 0; k < w->n; k++) {
+                slot = w->slot[k];
+                ne_global[k] = 0;
+                ni_global[k] = 0;
+                total = 0;
+                for (int r = 0; r < c->size; r++)
+                        total += part[r][2];
+                if (total > t->capacity)
+                        grow_table_of_spikes(t, total, S->ntw.N);
+                total = 0;
+                for (int r = 0; r < c->size; r++) {
+                        ne_global[k] += part[r][0];
+                        ni_global[k] += part[r][1];
+                        memcpy(t->indices[slot] + total, part[r] + 3, part[r][2] * sizeof(int));
+                        total += part[r][2];
+                        part[r] += 3 + part[r][2];
+                }
+                t->num_spikes[slot] = total;
+        }
+        free(buf);
+        free(all);
+        free(part);
+        free(sizes);
+}
+
+static void gather_spike_trains(struct State *S, struct Comm *c)
+{
+        /* Bring the history of the analyzed neurons to rank 0. Each rank
+         * sends its own, which holds only its neurons, so appending them one
+         * after the other keeps every train in order. */
+        struct SpikeHistory *h = &S->ntw.history;
+        struct SpikeEvent *buf, *all;
+        size_t n, total = 0, *sizes;
+
+        buf = emalloc((h->n > 0 ? h->n : 1) * sizeof(struct SpikeEvent));
+        for (size_t k = 0; k < h->n; k += n) {
+                n = h->n - k < HISTORY_CHUNK ? h->n - k : HISTORY_CHUNK;
+                memcpy(buf + k, h->chunk[k / HISTORY_CHUNK], n * sizeof(struct SpikeEvent));
+        }
+        sizes = emalloc(c->size * sizeof(size_t));
+        all = comm_gather(c, buf, h->n * sizeof(struct SpikeEvent), sizes);
+        if (c->rank == 0) {
+                for (int r = 0; r < c->size; r++)
+                        total += sizes[r] / sizeof(struct SpikeEvent);
+                /* The spikes of rank 0 are already in place */
+                for (size_t k = sizes[0] / sizeof(struct SpikeEvent); k < total; k++)
+                        record_spike(h, all[k].id, all[k].time);
+        }
+        free(all);
+        free(buf);
+        free(sizes);
+}
+
+static void gather_autocorrelation(struct State *S, struct Comm *c)
+{
+        /* Add the autocorrelation histograms of all ranks, each built from
+         * the spikes of its own neurons, on rank 0. The counts are whole
+         * numbers, so the sum does not depend on the order. */
+        struct SpikeAutocorrelation *a = S->sim.autocorrelation;
+        double buf[AC_BINS + 1], *all;
+        size_t *sizes = emalloc(c->size * sizeof(size_t));
+
+        memcpy(buf, a->h->bin, AC_BINS * sizeof(double));
+        buf[AC_BINS] = a->n_spikes;
+        all = comm_gather(c, buf, sizeof(buf), sizes);
+        if (c->rank == 0) {
+                for (int r = 1; r < c->size; r++) {
+                        for (int j = 0; j < AC_BINS; j++)
+                                a->h->bin[j] += all[r * (AC_BINS + 1) + j];
+                        a->n_spikes += (uint64_t) all[r * (AC_BINS + 1) + AC_BINS];
+                }
+        }
+        free(all);
+        free(sizes);
+}
+
+static void report_memory(struct State *S, struct Comm *c)
+{
+        /* Range and peak resident memory of every process */
+        struct rusage usage;
+        long mine[3], *all;
+        size_t *sizes = emalloc(c->size * sizeof(size_t));
+
+        getrusage(RUSAGE_SELF, &usage);
+        mine[0] = S->ntw.first_local;
+        mine[1] = S->ntw.last_local;
+        mine[2] = usage.ru_maxrss;
+        all = comm_gather(c, mine, sizeof(mine), sizes);
+        if (c->rank == 0 && S->sim.verbose) {
+                for (int r = 0; r < c->size; r++)
+                        report("Process %d: neurons %ld to %ld, peak memory %.1f MB.\n", r,
+                                        all[3 * r], all[3 * r + 1] - 1, all[3 * r + 2] / 1024.0);
+        }
+        free(all);
+        free(sizes);
+}
+
+void run_distributed(struct State *S, struct Comm *c)
+{
+        /* Simulate a trial of the network of S, of which this process holds
+         * its own range, and write the outputs */
+        struct Simulation *sim = &S->sim;
+        struct Network *ntw = &S->ntw;
+        struct Window w;
+        int *ne_global, *ni_global;
+        int lag = ntw->tab_spikes.lag;
+        int length = lag > 0 ? lag : 1;
+        int step = 0;
+        int ne_window = 0, ni_window = 0;
+        bool last;
+
+        /* The sampling window must be a whole number of time steps */
+        int n_skipped_samples = (int) rint(sim->time_window_size / sim->DT);
+        if (n_skipped_samples < 1)
+                n_skipped_samples = 1;
+        set_time_window_size(S, n_skipped_samples * sim->DT);
+
+        if (c->rank == 0) {
+                open_file_handlers(S);
+                open_rate_writer(S);
+                report("Distributing %d neurons over %d processes, exchanging spikes "
+                                "every %d time step(s).\n", ntw->N, c->size, length);
+        } else {
+                sim->show_progress = false;
+        }
+        w.n = 0;
+        w.slot = emalloc(length * sizeof(int));
+        w.time = emalloc(length * sizeof(double));
+        w.ne_spikes = emalloc(length * sizeof(int));
+        w.ni_spikes = emalloc(length * sizeof(int));
+        ne_global = emalloc(length * sizeof(int));
+        ni_global = emalloc(length * sizeof(int));
+
+        while (sim->time < sim->total_time) {
+                /* Same steps as simulate_one_step, with the exchange between
+                 * the update and the delivery, in case the delay is shorter
+                 * than a time step */
+                w.slot[w.n] = ntw->tab_spikes.i_curr;
+                update_membrane_potentials(S);
+                w.time[w.n] = sim->time + sim->DT;
+                w.ne_spikes[w.n] = ntw->ne_spikes;
+                w.ni_spikes[w.n] = ntw->ni_spikes;
+                ntw->ne_spikes = 0;
+                ntw->ni_spikes = 0;
+                w.n++;
+                last = !(sim->time + sim->DT < sim->total_time);
+                if (w.n == length || last) {
+                        exchange_spikes(S, c, &w, ne_global, ni_global);
+                        for (int k = 0; k < w.n; k++) {
+                                ne_window += ne_global[k];
+                                ni_window += ni_global[k];
+                                if (++step % n_skipped_samples != 0)
+                                        continue;
+                                if (c->rank == 0)
+                                        record_population_rate(S, w.time[k], ne_window, ni_window);
+                                ne_window = 0;
+                                ni_window = 0;
+                        }
+                        w.n = 0;
+                }
+                send_away_spikes(S);
+                update_pivots(S);
+                sim->time += sim->DT;
+        }
+
+        gather_spike_trains(S, c);
+        gather_autocorrelation(S, c);
+        if (c->rank == 0) {
+                close_rate_writer(S);
+                archive_spike_trains(S);
+                save_spike_activity(S);
+                fflush(sim->spikes_file);
+        }
+        /* Each rank appends its neurons to the final state in turn */
+        for (int r = 0; r < c->size; r++) {
+                if (c->rank == r)
+                        save_final_state(S);
+                comm_barrier(c);
+        }
+        report_memory(S, c);
+        if (c->rank == 0) {
+                report("\n");
+                compute_average_autocorrelations(S);
+                compute_global_autocorrelations(S);
+        }
+
+        free(w.slot);
+        free(w.time);
+        free(w.ne_spikes);
+        free(w.ni_spikes);
+        free(ne_global);
+        free(ni_global);
+}
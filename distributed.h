@@ -0,0 +1,9 @@
+#ifndef _DISTRIBUTED_H
+#define _DISTRIBUTED_H 1
+
+#include "simulation.h"
+#include "comm.h"
+
+/* distributed.c */
+void run_distributed(struct State *S, struct Comm *c);
+#endif
@@ -99,6 +99,16 @@ void *erealloc(void *vp, size_t n)
 	return p;
 }
 
+/* emalloc_aligned: malloc on a cache-line boundary and report if error */
+void *emalloc_aligned(size_t n)
+{
+	void *p;
+
+	if (posix_memalign(&p, 64, n) != 0)
+		eprintf("aligned malloc of %u bytes failed:", n);
+	return p;
+}
+
 /* estrdup: duplicate a string, report if error */
 char *estrdup(const char *s)
 {
@@ -12,6 +12,7 @@ extern void f_printf(FILE *dev, const char *fmt, ...);
 extern char *estrdup(const char *);
 extern void *emalloc(size_t);
 extern void *erealloc(void *, size_t);
+extern void *emalloc_aligned(size_t);
 extern char *progname(void);
 char *string_replace(char *, char, char);
 extern void setprogname(const char *);
@@ -0,0 +1,839 @@
+/* Kernels for the membrane update of a range of neurons.
+ *
+ * Each kernel advances neurons begin, ..., end - 1 by one time step, from
+ * time now (which blocked runs set per step, see run_trial_blocked): Euler
+ * step, refractoriness, threshold test, linear interpolation of the spike
+ * time, reset, and decay of the synaptic currents, all in a single pass. The
+ * indices and spike times of the neurons that fire are written, in
+ * increasing order, to ids and times, and the number of spikes is returned.
+ *
+ * There are two integration schemes. The Euler kernels advance V with a
+ * forward Euler step and interpolate the spike time linearly. The exact
+ * kernels use the analytical solution over one step (the propagator set up
+ * in set_propagator) and locate the threshold crossing on the analytical
+ * trajectory, which keeps them accurate at larger time steps.
+ *
+ * The vectorized kernels perform exactly the same floating-point operations,
+ * in the same order, as the scalar ones, so all kernels of a scheme produce
+ * bit-identical results. This is why the code is compiled with
+ * -ffp-contract=off: fused multiply-adds would round differently. */
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+int integrate_scalar(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        struct NeuronState *cell = &ntw->cell;
+        const real dt = S->sim.DT;
+        const real decay_fast = S->sim.exp_decay_fast;
+        const real decay_slow = S->sim.exp_decay_slow;
+        const real thr = V_thr;
+        const real reset = V_reset;
+        real V_k, interpolator;
+        int n = 0;
+
+        for (int j = begin; j < end; j++) {
+                if ( cell->ref_state[j] > 0 ) {
+                        cell->ref_state[j]--;
+                } else {
+                        V_k = cell->V_m[j];
+                        cell->V_m[j] += dt * euler(ntw, V_k, cell->I_fast[j], cell->I_slow[j]);
+
+                        /* Threshold crossing ------------------------- */
+                        if ( cell->V_m[j] >= thr ) {
+                                interpolator = (thr - V_k) / (cell->V_m[j] - V_k); /* This should be in [0,1] */
+                                ids[n] = j;
+                                times[n] = now + interpolator * dt;
+                                n++;
+                                cell->ref_state[j] = ntw->top_ref_state;
+                                cell->V_m[j] = reset
+                                        + dt * euler(ntw, reset, cell->I_fast[j], cell->I_slow[j])
+                                        * ((real) 1 - interpolator);
+                        }
+                }
+                /* Update currents */
+                cell->I_fast[j] *= decay_fast;
+                if (ntw->slow_flag)
+                        cell->I_slow[j] *= decay_slow;
+        }
+        return n;
+}
+
+static double membrane_at(const struct State *S, double t, double V_0,
+                double I_f, double I_s, double *dVdt)
+{
+        /* Membrane potential a time t after it was V_0, with currents I_f
+         * and I_s at that moment, and its time derivative */
+        const struct Network *ntw = &S->ntw;
+        double mu = ntw->ext_current;
+        double e_m = exp(-t / ntw->tau_m);
+        double V = mu + (V_0 - mu) * e_m
+                + I_f * membrane_response(t, ntw->tau_fast, ntw->tau_m);
+        double I = I_f * exp(-t / ntw->tau_fast);
+
+        if (ntw->slow_flag) {
+                V += I_s * membrane_response(t, ntw->tau_slow, ntw->tau_m);
+                I += I_s * exp(-t / ntw->tau_slow);
+        }
+        *dVdt = (-V + mu + I) / ntw->tau_m;
+        return V;
+}
+
+static double exact_threshold_crossing(const struct State *S, double V_k,
+                double *V, double I_f, double I_s)
+{
+        /* The membrane went from V_k below threshold to *V above it during
+         * the last step. Find when it crossed, starting from the linear
+         * interpolation and refining with Newton's method on the analytical
+         * trajectory. Then reset the neuron and let it evolve, still exactly,
+         * until the end of the step. Returns the time of the crossing
+         * relative to the beginning of the step. */
+        const struct Network *ntw = &S->ntw;
+        double dt = S->sim.DT;
+        double t = dt * (V_thr - V_k) / (*V - V_k);
+        double V_t, dVdt;
+
+        for (int iter = 0; iter < 8; iter++) {
+                V_t = membrane_at(S, t, V_k, I_f, I_s, &dVdt);
+                if (fabs(V_t - V_thr) < 1e-12 || dVdt <= 0)
+                        break;
+                t -= (V_t - V_thr) / dVdt;
+                if (t < 0)
+                        t = 0;
+                else if (t > dt)
+                        t = dt;
+        }
+        I_f *= exp(-t / ntw->tau_fast);
+        if (ntw->slow_flag)
+                I_s *= exp(-t / ntw->tau_slow);
+        *V = membrane_at(S, dt - t, V_reset, I_f, I_s, &dVdt);
+        return t;
+}
+
+int integrate_exact_scalar(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        struct NeuronState *cell = &ntw->cell;
+        const real decay_fast = S->sim.exp_decay_fast;
+        const real decay_slow = S->sim.exp_decay_slow;
+        const real prop_mm = S->sim.prop_mm;
+        const real prop_ext = S->sim.prop_ext;
+        const real prop_fast = S->sim.prop_fast;
+        const real prop_slow = S->sim.prop_slow;
+        const real thr = V_thr;
+        real V_k;
+        double V;
+        int n = 0;
+
+        for (int j = begin; j < end; j++) {
+                if ( cell->ref_state[j] > 0 ) {
+                        cell->ref_state[j]--;
+                } else {
+                        V_k = cell->V_m[j];
+                        cell->V_m[j] = prop_mm * V_k + prop_ext
+                                + prop_fast * cell->I_fast[j] + prop_slow * cell->I_slow[j];
+
+                        /* Threshold crossing ------------------------- */
+                        if ( cell->V_m[j] >= thr ) {
+                                V = cell->V_m[j];
+                                ids[n] = j;
+                                times[n] = now + exact_threshold_crossing(S, V_k,
+                                                &V, cell->I_fast[j], cell->I_slow[j]);
+                                cell->V_m[j] = V;
+                                n++;
+                                cell->ref_state[j] = ntw->top_ref_state;
+                        }
+                }
+                /* Update currents */
+                cell->I_fast[j] *= decay_fast;
+                if (ntw->slow_flag)
+                        cell->I_slow[j] *= decay_slow;
+        }
+        return n;
+}
+
+#if defined(HAVE_X86_KERNELS) && !defined(SINGLE_PRECISION)
+__attribute__((target("avx2")))
+int integrate_avx2(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        double *V_m = ntw->cell.V_m;
+        double *I_fast = ntw->cell.I_fast;
+        double *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m256d thr = _mm256_set1_pd(V_thr);
+        const __m256d reset = _mm256_set1_pd(V_reset);
+        const __m256d mu = _mm256_set1_pd(ntw->ext_current);
+        const __m256d tau = _mm256_set1_pd(ntw->tau_m);
+        const __m256d dt = _mm256_set1_pd(S->sim.DT);
+        const __m256d t_now = _mm256_set1_pd(now);
+        const __m256d one = _mm256_set1_pd(1.0);
+        const __m256d decay_fast = _mm256_set1_pd(S->sim.exp_decay_fast);
+        const __m256d decay_slow = _mm256_set1_pd(S->sim.exp_decay_slow);
+        const __m128i zero_i = _mm_setzero_si128();
+        const __m128i one_i = _mm_set1_epi32(1);
+        __m256d V_k, V, V_fired, I_f, I_s, frozen, fired, drift, interpolator;
+        __m128i ref, refractory;
+        double t_sp[4];
+        int n = 0, mask, b, j;
+
+        for (j = begin; j + 4 <= end; j += 4) {
+                ref = _mm_loadu_si128((const __m128i *) &ref_state[j]);
+                refractory = _mm_cmpgt_epi32(ref, zero_i);
+                frozen = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(refractory));
+                ref = _mm_sub_epi32(ref, _mm_and_si128(refractory, one_i));
+
+                V_k = _mm256_loadu_pd(&V_m[j]);
+                I_f = _mm256_loadu_pd(&I_fast[j]);
+                I_s = _mm256_loadu_pd(&I_slow[j]);
+                /* Euler step, same order of operations as in euler() */
+                drift = _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(
+                                        _mm256_sub_pd(mu, V_k), I_f), I_s), tau);
+                V = _mm256_add_pd(V_k, _mm256_mul_pd(dt, drift));
+                V = _mm256_blendv_pd(V, V_k, frozen);
+
+                /* Threshold crossing ------------------------- */
+                fired = _mm256_andnot_pd(frozen, _mm256_cmp_pd(V, thr, _CMP_GE_OQ));
+                mask = _mm256_movemask_pd(fired);
+                if (mask) {
+                        interpolator = _mm256_div_pd(_mm256_sub_pd(thr, V_k),
+                                        _mm256_sub_pd(V, V_k));
+                        drift = _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(
+                                                _mm256_sub_pd(mu, reset), I_f), I_s), tau);
+                        V_fired = _mm256_add_pd(reset, _mm256_mul_pd(
+                                                _mm256_mul_pd(dt, drift),
+                                                _mm256_sub_pd(one, interpolator)));
+                        V = _mm256_blendv_pd(V, V_fired, fired);
+                        _mm256_storeu_pd(t_sp, _mm256_add_pd(t_now,
+                                                _mm256_mul_pd(interpolator, dt)));
+                }
+                _mm256_storeu_pd(&V_m[j], V);
+                _mm_storeu_si128((__m128i *) &ref_state[j], ref);
+                /* Compact the spikes */
+                while (mask) {
+                        b = __builtin_ctz(mask);
+                        ids[n] = j + b;
+                        times[n] = t_sp[b];
+                        ref_state[j + b] = ntw->top_ref_state;
+                        n++;
+                        mask &= mask - 1;
+                }
+
+                /* Update currents */
+                _mm256_storeu_pd(&I_fast[j], _mm256_mul_pd(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm256_storeu_pd(&I_slow[j], _mm256_mul_pd(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_scalar(S, now, j, end, ids + n, times + n);
+}
+
+__attribute__((target("avx512f")))
+int integrate_avx512(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        double *V_m = ntw->cell.V_m;
+        double *I_fast = ntw->cell.I_fast;
+        double *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m512d thr = _mm512_set1_pd(V_thr);
+        const __m512d reset = _mm512_set1_pd(V_reset);
+        const __m512d mu = _mm512_set1_pd(ntw->ext_current);
+        const __m512d tau = _mm512_set1_pd(ntw->tau_m);
+        const __m512d dt = _mm512_set1_pd(S->sim.DT);
+        const __m512d t_now = _mm512_set1_pd(now);
+        const __m512d one = _mm512_set1_pd(1.0);
+        const __m512d decay_fast = _mm512_set1_pd(S->sim.exp_decay_fast);
+        const __m512d decay_slow = _mm512_set1_pd(S->sim.exp_decay_slow);
+        /* The refractory counters are handled with 256-bit integer
+         * operations: masked 512-bit accesses to an 8-int array defeat
+         * store-to-load forwarding between iterations. */
+        const __m256i zero_i = _mm256_setzero_si256();
+        const __m256i one_i = _mm256_set1_epi32(1);
+        const __m256i top = _mm256_set1_epi32(ntw->top_ref_state);
+        const __m256i bit = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+        const __m512i lane = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                        7, 6, 5, 4, 3, 2, 1, 0);
+        __m512d V_k, V, V_fired, I_f, I_s, drift, interpolator;
+        __m256i ref, refractory, just_fired;
+        __mmask8 frozen, fired;
+        int n = 0, j;
+
+        for (j = begin; j + 8 <= end; j += 8) {
+                ref = _mm256_loadu_si256((const __m256i *) &ref_state[j]);
+                refractory = _mm256_cmpgt_epi32(ref, zero_i);
+                frozen = (__mmask8) _mm256_movemask_ps(_mm256_castsi256_ps(refractory));
+                ref = _mm256_sub_epi32(ref, _mm256_and_si256(refractory, one_i));
+
+                V_k = _mm512_loadu_pd(&V_m[j]);
+                I_f = _mm512_loadu_pd(&I_fast[j]);
+                I_s = _mm512_loadu_pd(&I_slow[j]);
+                /* Euler step, same order of operations as in euler() */
+                drift = _mm512_div_pd(_mm512_add_pd(_mm512_add_pd(
+                                        _mm512_sub_pd(mu, V_k), I_f), I_s), tau);
+                V = _mm512_add_pd(V_k, _mm512_mul_pd(dt, drift));
+                V = _mm512_mask_blend_pd(frozen, V, V_k);
+
+                /* Threshold crossing ------------------------- */
+                fired = _mm512_mask_cmp_pd_mask(~frozen, V, thr, _CMP_GE_OQ);
+                if (fired) {
+                        interpolator = _mm512_div_pd(_mm512_sub_pd(thr, V_k),
+                                        _mm512_sub_pd(V, V_k));
+                        drift = _mm512_div_pd(_mm512_add_pd(_mm512_add_pd(
+                                                _mm512_sub_pd(mu, reset), I_f), I_s), tau);
+                        V_fired = _mm512_add_pd(reset, _mm512_mul_pd(
+                                                _mm512_mul_pd(dt, drift),
+                                                _mm512_sub_pd(one, interpolator)));
+                        V = _mm512_mask_blend_pd(fired, V, V_fired);
+                        just_fired = _mm256_cmpeq_epi32(_mm256_and_si256(
+                                                _mm256_set1_epi32(fired), bit), bit);
+                        ref = _mm256_blendv_epi8(ref, top, just_fired);
+                        /* Compact the spikes */
+                        _mm512_mask_compressstoreu_epi32(&ids[n], fired,
+                                        _mm512_add_epi32(_mm512_set1_epi32(j), lane));
+                        _mm512_mask_compressstoreu_pd(&times[n], fired,
+                                        _mm512_add_pd(t_now, _mm512_mul_pd(interpolator, dt)));
+                        n += __builtin_popcount(fired);
+                }
+                _mm512_storeu_pd(&V_m[j], V);
+                _mm256_storeu_si256((__m256i *) &ref_state[j], ref);
+
+                /* Update currents */
+                _mm512_storeu_pd(&I_fast[j], _mm512_mul_pd(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm512_storeu_pd(&I_slow[j], _mm512_mul_pd(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_scalar(S, now, j, end, ids + n, times + n);
+}
+
+__attribute__((target("avx2")))
+int integrate_exact_avx2(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        double *V_m = ntw->cell.V_m;
+        double *I_fast = ntw->cell.I_fast;
+        double *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m256d thr = _mm256_set1_pd(V_thr);
+        const __m256d prop_mm = _mm256_set1_pd(S->sim.prop_mm);
+        const __m256d prop_ext = _mm256_set1_pd(S->sim.prop_ext);
+        const __m256d prop_fast = _mm256_set1_pd(S->sim.prop_fast);
+        const __m256d prop_slow = _mm256_set1_pd(S->sim.prop_slow);
+        const __m256d decay_fast = _mm256_set1_pd(S->sim.exp_decay_fast);
+        const __m256d decay_slow = _mm256_set1_pd(S->sim.exp_decay_slow);
+        const __m128i zero_i = _mm_setzero_si128();
+        const __m128i one_i = _mm_set1_epi32(1);
+        __m256d V_k, V, I_f, I_s, frozen;
+        __m128i ref, refractory;
+        double V_pre[4];
+        int n = 0, mask, b, j;
+
+        for (j = begin; j + 4 <= end; j += 4) {
+                ref = _mm_loadu_si128((const __m128i *) &ref_state[j]);
+                refractory = _mm_cmpgt_epi32(ref, zero_i);
+                frozen = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(refractory));
+                ref = _mm_sub_epi32(ref, _mm_and_si128(refractory, one_i));
+                _mm_storeu_si128((__m128i *) &ref_state[j], ref);
+
+                V_k = _mm256_loadu_pd(&V_m[j]);
+                I_f = _mm256_loadu_pd(&I_fast[j]);
+                I_s = _mm256_loadu_pd(&I_slow[j]);
+                /* Propagator, same order of operations as the scalar kernel */
+                V = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+                                                _mm256_mul_pd(prop_mm, V_k), prop_ext),
+                                        _mm256_mul_pd(prop_fast, I_f)),
+                                _mm256_mul_pd(prop_slow, I_s));
+                V = _mm256_blendv_pd(V, V_k, frozen);
+                _mm256_storeu_pd(&V_m[j], V);
+
+                /* Threshold crossings are rare: handle them one by one */
+                mask = _mm256_movemask_pd(_mm256_andnot_pd(frozen,
+                                        _mm256_cmp_pd(V, thr, _CMP_GE_OQ)));
+                if (mask)
+                        _mm256_storeu_pd(V_pre, V_k);
+                while (mask) {
+                        b = __builtin_ctz(mask);
+                        ids[n] = j + b;
+                        times[n] = now + exact_threshold_crossing(S, V_pre[b],
+                                        &V_m[j + b], I_fast[j + b], I_slow[j + b]);
+                        ref_state[j + b] = ntw->top_ref_state;
+                        n++;
+                        mask &= mask - 1;
+                }
+
+                /* Update currents */
+                _mm256_storeu_pd(&I_fast[j], _mm256_mul_pd(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm256_storeu_pd(&I_slow[j], _mm256_mul_pd(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_exact_scalar(S, now, j, end, ids + n, times + n);
+}
+
+__attribute__((target("avx512f")))
+int integrate_exact_avx512(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        double *V_m = ntw->cell.V_m;
+        double *I_fast = ntw->cell.I_fast;
+        double *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m512d thr = _mm512_set1_pd(V_thr);
+        const __m512d prop_mm = _mm512_set1_pd(S->sim.prop_mm);
+        const __m512d prop_ext = _mm512_set1_pd(S->sim.prop_ext);
+        const __m512d prop_fast = _mm512_set1_pd(S->sim.prop_fast);
+        const __m512d prop_slow = _mm512_set1_pd(S->sim.prop_slow);
+        const __m512d decay_fast = _mm512_set1_pd(S->sim.exp_decay_fast);
+        const __m512d decay_slow = _mm512_set1_pd(S->sim.exp_decay_slow);
+        const __m256i zero_i = _mm256_setzero_si256();
+        const __m256i one_i = _mm256_set1_epi32(1);
+        __m512d V_k, V, I_f, I_s;
+        __m256i ref, refractory;
+        __mmask8 frozen;
+        double V_pre[8];
+        int n = 0, mask, b, j;
+
+        for (j = begin; j + 8 <= end; j += 8) {
+                ref = _mm256_loadu_si256((const __m256i *) &ref_state[j]);
+                refractory = _mm256_cmpgt_epi32(ref, zero_i);
+                frozen = (__mmask8) _mm256_movemask_ps(_mm256_castsi256_ps(refractory));
+                ref = _mm256_sub_epi32(ref, _mm256_and_si256(refractory, one_i));
+                _mm256_storeu_si256((__m256i *) &ref_state[j], ref);
+
+                V_k = _mm512_loadu_pd(&V_m[j]);
+                I_f = _mm512_loadu_pd(&I_fast[j]);
+                I_s = _mm512_loadu_pd(&I_slow[j]);
+                /* Propagator, same order of operations as the scalar kernel */
+                V = _mm512_add_pd(_mm512_add_pd(_mm512_add_pd(
+                                                _mm512_mul_pd(prop_mm, V_k), prop_ext),
+                                        _mm512_mul_pd(prop_fast, I_f)),
+                                _mm512_mul_pd(prop_slow, I_s));
+                V = _mm512_mask_blend_pd(frozen, V, V_k);
+                _mm512_storeu_pd(&V_m[j], V);
+
+                /* Threshold crossings are rare: handle them one by one */
+                mask = _mm512_mask_cmp_pd_mask(~frozen, V, thr, _CMP_GE_OQ);
+                if (mask)
+                        _mm512_storeu_pd(V_pre, V_k);
+                while (mask) {
+                        b = __builtin_ctz(mask);
+                        ids[n] = j + b;
+                        times[n] = now + exact_threshold_crossing(S, V_pre[b],
+                                        &V_m[j + b], I_fast[j + b], I_slow[j + b]);
+                        ref_state[j + b] = ntw->top_ref_state;
+                        n++;
+                        mask &= mask - 1;
+                }
+
+                /* Update currents */
+                _mm512_storeu_pd(&I_fast[j], _mm512_mul_pd(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm512_storeu_pd(&I_slow[j], _mm512_mul_pd(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_exact_scalar(S, now, j, end, ids + n, times + n);
+}
+#elif defined(HAVE_X86_KERNELS)
+/* Single-precision kernels. They follow the double-precision ones with
+ * twice as many neurons per vector: 8 with AVX2 and 16 with AVX-512. The
+ * refractory counters then fill a whole integer vector, and the offset of
+ * each spike time within the step is computed in single precision and
+ * added to the (double) time of the step, as in the scalar kernels. */
+__attribute__((target("avx2")))
+int integrate_avx2(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        float *V_m = ntw->cell.V_m;
+        float *I_fast = ntw->cell.I_fast;
+        float *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m256 thr = _mm256_set1_ps(V_thr);
+        const __m256 reset = _mm256_set1_ps(V_reset);
+        const __m256 mu = _mm256_set1_ps(ntw->ext_current);
+        const __m256 tau = _mm256_set1_ps(ntw->tau_m);
+        const __m256 dt = _mm256_set1_ps(S->sim.DT);
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 decay_fast = _mm256_set1_ps(S->sim.exp_decay_fast);
+        const __m256 decay_slow = _mm256_set1_ps(S->sim.exp_decay_slow);
+        const __m256i zero_i = _mm256_setzero_si256();
+        const __m256i one_i = _mm256_set1_epi32(1);
+        __m256 V_k, V, V_fired, I_f, I_s, frozen, fired, drift, interpolator;
+        __m256i ref, refractory;
+        float t_sp[8];
+        int n = 0, mask, b, j;
+
+        for (j = begin; j + 8 <= end; j += 8) {
+                ref = _mm256_loadu_si256((const __m256i *) &ref_state[j]);
+                refractory = _mm256_cmpgt_epi32(ref, zero_i);
+                frozen = _mm256_castsi256_ps(refractory);
+                ref = _mm256_sub_epi32(ref, _mm256_and_si256(refractory, one_i));
+
+                V_k = _mm256_loadu_ps(&V_m[j]);
+                I_f = _mm256_loadu_ps(&I_fast[j]);
+                I_s = _mm256_loadu_ps(&I_slow[j]);
+                /* Euler step, same order of operations as in euler() */
+                drift = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(
+                                        _mm256_sub_ps(mu, V_k), I_f), I_s), tau);
+                V = _mm256_add_ps(V_k, _mm256_mul_ps(dt, drift));
+                V = _mm256_blendv_ps(V, V_k, frozen);
+
+                /* Threshold crossing ------------------------- */
+                fired = _mm256_andnot_ps(frozen, _mm256_cmp_ps(V, thr, _CMP_GE_OQ));
+                mask = _mm256_movemask_ps(fired);
+                if (mask) {
+                        interpolator = _mm256_div_ps(_mm256_sub_ps(thr, V_k),
+                                        _mm256_sub_ps(V, V_k));
+                        drift = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(
+                                                _mm256_sub_ps(mu, reset), I_f), I_s), tau);
+                        V_fired = _mm256_add_ps(reset, _mm256_mul_ps(
+                                                _mm256_mul_ps(dt, drift),
+                                                _mm256_sub_ps(one, interpolator)));
+                        V = _mm256_blendv_ps(V, V_fired, fired);
+                        _mm256_storeu_ps(t_sp, _mm256_mul_ps(interpolator, dt));
+                }
+                _mm256_storeu_ps(&V_m[j], V);
+                _mm256_storeu_si256((__m256i *) &ref_state[j], ref);
+                /* Compact the spikes */
+                while (mask) {
+                        b = __builtin_ctz(mask);
+                        ids[n] = j + b;
+                        times[n] = now + t_sp[b];
+                        ref_state[j + b] = ntw->top_ref_state;
+                        n++;
+                        mask &= mask - 1;
+                }
+
+                /* Update currents */
+                _mm256_storeu_ps(&I_fast[j], _mm256_mul_ps(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm256_storeu_ps(&I_slow[j], _mm256_mul_ps(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_scalar(S, now, j, end, ids + n, times + n);
+}
+
+__attribute__((target("avx512f")))
+int integrate_avx512(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        float *V_m = ntw->cell.V_m;
+        float *I_fast = ntw->cell.I_fast;
+        float *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m512 thr = _mm512_set1_ps(V_thr);
+        const __m512 reset = _mm512_set1_ps(V_reset);
+        const __m512 mu = _mm512_set1_ps(ntw->ext_current);
+        const __m512 tau = _mm512_set1_ps(ntw->tau_m);
+        const __m512 dt = _mm512_set1_ps(S->sim.DT);
+        const __m512 one = _mm512_set1_ps(1.0f);
+        const __m512 decay_fast = _mm512_set1_ps(S->sim.exp_decay_fast);
+        const __m512 decay_slow = _mm512_set1_ps(S->sim.exp_decay_slow);
+        const __m512i zero_i = _mm512_setzero_si512();
+        const __m512i one_i = _mm512_set1_epi32(1);
+        const __m512i top = _mm512_set1_epi32(ntw->top_ref_state);
+        const __m512i lane = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                        7, 6, 5, 4, 3, 2, 1, 0);
+        __m512 V_k, V, V_fired, I_f, I_s, drift, interpolator;
+        __m512i ref;
+        __mmask16 frozen, fired;
+        float t_sp[16];
+        int n = 0, n_fired, j;
+
+        for (j = begin; j + 16 <= end; j += 16) {
+                ref = _mm512_loadu_si512(&ref_state[j]);
+                frozen = _mm512_cmpgt_epi32_mask(ref, zero_i);
+                ref = _mm512_mask_sub_epi32(ref, frozen, ref, one_i);
+
+                V_k = _mm512_loadu_ps(&V_m[j]);
+                I_f = _mm512_loadu_ps(&I_fast[j]);
+                I_s = _mm512_loadu_ps(&I_slow[j]);
+                /* Euler step, same order of operations as in euler() */
+                drift = _mm512_div_ps(_mm512_add_ps(_mm512_add_ps(
+                                        _mm512_sub_ps(mu, V_k), I_f), I_s), tau);
+                V = _mm512_add_ps(V_k, _mm512_mul_ps(dt, drift));
+                V = _mm512_mask_blend_ps(frozen, V, V_k);
+
+                /* Threshold crossing ------------------------- */
+                fired = _mm512_mask_cmp_ps_mask(~frozen, V, thr, _CMP_GE_OQ);
+                if (fired) {
+                        interpolator = _mm512_div_ps(_mm512_sub_ps(thr, V_k),
+                                        _mm512_sub_ps(V, V_k));
+                        drift = _mm512_div_ps(_mm512_add_ps(_mm512_add_ps(
+                                                _mm512_sub_ps(mu, reset), I_f), I_s), tau);
+                        V_fired = _mm512_add_ps(reset, _mm512_mul_ps(
+                                                _mm512_mul_ps(dt, drift),
+                                                _mm512_sub_ps(one, interpolator)));
+                        V = _mm512_mask_blend_ps(fired, V, V_fired);
+                        ref = _mm512_mask_mov_epi32(ref, fired, top);
+                        /* Compact the spikes */
+                        _mm512_mask_compressstoreu_epi32(&ids[n], fired,
+                                        _mm512_add_epi32(_mm512_set1_epi32(j), lane));
+                        _mm512_mask_compressstoreu_ps(t_sp, fired,
+                                        _mm512_mul_ps(interpolator, dt));
+                        n_fired = __builtin_popcount(fired);
+                        for (int k = 0; k < n_fired; k++)
+                                times[n + k] = now + t_sp[k];
+                        n += n_fired;
+                }
+                _mm512_storeu_ps(&V_m[j], V);
+                _mm512_storeu_si512(&ref_state[j], ref);
+
+                /* Update currents */
+                _mm512_storeu_ps(&I_fast[j], _mm512_mul_ps(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm512_storeu_ps(&I_slow[j], _mm512_mul_ps(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_scalar(S, now, j, end, ids + n, times + n);
+}
+
+__attribute__((target("avx2")))
+int integrate_exact_avx2(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        float *V_m = ntw->cell.V_m;
+        float *I_fast = ntw->cell.I_fast;
+        float *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m256 thr = _mm256_set1_ps(V_thr);
+        const __m256 prop_mm = _mm256_set1_ps(S->sim.prop_mm);
+        const __m256 prop_ext = _mm256_set1_ps(S->sim.prop_ext);
+        const __m256 prop_fast = _mm256_set1_ps(S->sim.prop_fast);
+        const __m256 prop_slow = _mm256_set1_ps(S->sim.prop_slow);
+        const __m256 decay_fast = _mm256_set1_ps(S->sim.exp_decay_fast);
+        const __m256 decay_slow = _mm256_set1_ps(S->sim.exp_decay_slow);
+        const __m256i zero_i = _mm256_setzero_si256();
+        const __m256i one_i = _mm256_set1_epi32(1);
+        __m256 V_k, V, I_f, I_s, frozen;
+        __m256i ref, refractory;
+        float V_pre[8];
+        double V_end;
+        int n = 0, mask, b, j;
+
+        for (j = begin; j + 8 <= end; j += 8) {
+                ref = _mm256_loadu_si256((const __m256i *) &ref_state[j]);
+                refractory = _mm256_cmpgt_epi32(ref, zero_i);
+                frozen = _mm256_castsi256_ps(refractory);
+                ref = _mm256_sub_epi32(ref, _mm256_and_si256(refractory, one_i));
+                _mm256_storeu_si256((__m256i *) &ref_state[j], ref);
+
+                V_k = _mm256_loadu_ps(&V_m[j]);
+                I_f = _mm256_loadu_ps(&I_fast[j]);
+                I_s = _mm256_loadu_ps(&I_slow[j]);
+                /* Propagator, same order of operations as the scalar kernel */
+                V = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                                                _mm256_mul_ps(prop_mm, V_k), prop_ext),
+                                        _mm256_mul_ps(prop_fast, I_f)),
+                                _mm256_mul_ps(prop_slow, I_s));
+                V = _mm256_blendv_ps(V, V_k, frozen);
+                _mm256_storeu_ps(&V_m[j], V);
+
+                /* Threshold crossings are rare: handle them one by one */
+                mask = _mm256_movemask_ps(_mm256_andnot_ps(frozen,
+                                        _mm256_cmp_ps(V, thr, _CMP_GE_OQ)));
+                if (mask)
+                        _mm256_storeu_ps(V_pre, V_k);
+                while (mask) {
+                        b = __builtin_ctz(mask);
+                        V_end = V_m[j + b];
+                        ids[n] = j + b;
+                        times[n] = now + exact_threshold_crossing(S, V_pre[b],
+                                        &V_end, I_fast[j + b], I_slow[j + b]);
+                        V_m[j + b] = V_end;
+                        ref_state[j + b] = ntw->top_ref_state;
+                        n++;
+                        mask &= mask - 1;
+                }
+
+                /* Update currents */
+                _mm256_storeu_ps(&I_fast[j], _mm256_mul_ps(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm256_storeu_ps(&I_slow[j], _mm256_mul_ps(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_exact_scalar(S, now, j, end, ids + n, times + n);
+}
+
+__attribute__((target("avx512f")))
+int integrate_exact_avx512(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        struct Network *ntw = &S->ntw;
+        float *V_m = ntw->cell.V_m;
+        float *I_fast = ntw->cell.I_fast;
+        float *I_slow = ntw->cell.I_slow;
+        int *ref_state = ntw->cell.ref_state;
+        const __m512 thr = _mm512_set1_ps(V_thr);
+        const __m512 prop_mm = _mm512_set1_ps(S->sim.prop_mm);
+        const __m512 prop_ext = _mm512_set1_ps(S->sim.prop_ext);
+        const __m512 prop_fast = _mm512_set1_ps(S->sim.prop_fast);
+        const __m512 prop_slow = _mm512_set1_ps(S->sim.prop_slow);
+        const __m512 decay_fast = _mm512_set1_ps(S->sim.exp_decay_fast);
+        const __m512 decay_slow = _mm512_set1_ps(S->sim.exp_decay_slow);
+        const __m512i zero_i = _mm512_setzero_si512();
+        const __m512i one_i = _mm512_set1_epi32(1);
+        __m512 V_k, V, I_f, I_s;
+        __m512i ref;
+        __mmask16 frozen;
+        float V_pre[16];
+        double V_end;
+        int n = 0, mask, b, j;
+
+        for (j = begin; j + 16 <= end; j += 16) {
+                ref = _mm512_loadu_si512(&ref_state[j]);
+                frozen = _mm512_cmpgt_epi32_mask(ref, zero_i);
+                ref = _mm512_mask_sub_epi32(ref, frozen, ref, one_i);
+                _mm512_storeu_si512(&ref_state[j], ref);
+
+                V_k = _mm512_loadu_ps(&V_m[j]);
+                I_f = _mm512_loadu_ps(&I_fast[j]);
+                I_s = _mm512_loadu_ps(&I_slow[j]);
+                /* Propagator, same order of operations as the scalar kernel */
+                V = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(
+                                                _mm512_mul_ps(prop_mm, V_k), prop_ext),
+                                        _mm512_mul_ps(prop_fast, I_f)),
+                                _mm512_mul_ps(prop_slow, I_s));
+                V = _mm512_mask_blend_ps(frozen, V, V_k);
+                _mm512_storeu_ps(&V_m[j], V);
+
+                /* Threshold crossings are rare: handle them one by one */
+                mask = _mm512_mask_cmp_ps_mask(~frozen, V, thr, _CMP_GE_OQ);
+                if (mask)
+                        _mm512_storeu_ps(V_pre, V_k);
+                while (mask) {
+                        b = __builtin_ctz(mask);
+                        V_end = V_m[j + b];
+                        ids[n] = j + b;
+                        times[n] = now + exact_threshold_crossing(S, V_pre[b],
+                                        &V_end, I_fast[j + b], I_slow[j + b]);
+                        V_m[j + b] = V_end;
+                        ref_state[j + b] = ntw->top_ref_state;
+                        n++;
+                        mask &= mask - 1;
+                }
+
+                /* Update currents */
+                _mm512_storeu_ps(&I_fast[j], _mm512_mul_ps(I_f, decay_fast));
+                if (ntw->slow_flag)
+                        _mm512_storeu_ps(&I_slow[j], _mm512_mul_ps(I_s, decay_slow));
+        }
+        /* Remainder */
+        return n + integrate_exact_scalar(S, now, j, end, ids + n, times + n);
+}
+#else
+int integrate_avx2(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        return integrate_scalar(S, now, begin, end, ids, times);
+}
+
+int integrate_avx512(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        return integrate_scalar(S, now, begin, end, ids, times);
+}
+
+int integrate_exact_avx2(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        return integrate_exact_scalar(S, now, begin, end, ids, times);
+}
+
+int integrate_exact_avx512(struct State *S, double now, int begin, int end, int *ids, double *times)
+{
+        return integrate_exact_scalar(S, now, begin, end, ids, times);
+}
+#endif
+
+static bool kernel_supported(enum Kernel k)
+{
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        switch (k) {
+                case KERNEL_AVX512:
+                        return __builtin_cpu_supports("avx512f");
+                case KERNEL_AVX2:
+                        return __builtin_cpu_supports("avx2");
+                default:
+                        return true;
+        }
+#else
+        return k == KERNEL_SCALAR || k == KERNEL_AUTO;
+#endif
+}
+
+integrate_kernel select_kernel(enum Kernel *k, enum Integrator integrator)
+{
+        /* Unless a specific kernel was requested, prefer AVX2: the update is
+         * bound by the division by tau_m, whose throughput per element is
+         * the same at both vector widths on current cores. Fall back to the
+         * scalar kernel if the requested one cannot run here. */
+        if (*k == KERNEL_AUTO) {
+                if (kernel_supported(KERNEL_AVX2))
+                        *k = KERNEL_AVX2;
+                else if (kernel_supported(KERNEL_AVX512))
+                        *k = KERNEL_AVX512;
+                else
+                        *k = KERNEL_SCALAR;
+        } else if (!kernel_supported(*k)) {
+                weprintf("the %s kernel is not supported by this CPU, using the scalar one",
+                                kernel_name(*k));
+                *k = KERNEL_SCALAR;
+        }
+
+        switch (*k) {
+                case KERNEL_AVX512:
+                        return integrator == INTEGRATOR_EXACT ?
+                                integrate_exact_avx512 : integrate_avx512;
+                case KERNEL_AVX2:
+                        return integrator == INTEGRATOR_EXACT ?
+                                integrate_exact_avx2 : integrate_avx2;
+                default:
+                        return integrator == INTEGRATOR_EXACT ?
+                                integrate_exact_scalar : integrate_scalar;
+        }
+}
+
+enum Kernel parse_kernel(const char *s)
+{
+        if (strcmp(s, "auto") == 0)
+                return KERNEL_AUTO;
+        else if (strcmp(s, "scalar") == 0)
+                return KERNEL_SCALAR;
+        else if (strcmp(s, "avx2") == 0)
+                return KERNEL_AVX2;
+        else if (strcmp(s, "avx512") == 0)
+                return KERNEL_AVX512;
+        report("Unknown kernel '%s'. Using 'auto'.\n", s);
+        return KERNEL_AUTO;
+}
+
+const char *kernel_name(enum Kernel k)
+{
+        switch (k) {
+                case KERNEL_SCALAR:
+                        return "scalar";
+                case KERNEL_AVX2:
+                        return "avx2";
+                case KERNEL_AVX512:
+                        return "avx512";
+                default:
+                        return "auto";
+        }
+}
+
+enum Integrator parse_integrator(const char *s)
+{
+        if (strcmp(s, "euler") == 0)
+                return INTEGRATOR_EULER;
+        else if (strcmp(s, "exact") == 0)
+                return INTEGRATOR_EXACT;
+        report("Unknown integration scheme '%s'. Using 'euler'.\n", s);
+        return INTEGRATOR_EULER;
+}
+
+const char *integrator_name(enum Integrator i)
+{
+        return i == INTEGRATOR_EXACT ? "exact" : "euler";
+}
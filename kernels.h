@@ -0,0 +1,18 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H 1
+
+#include "simulation.h"
+
+/* kernels.c */
+int integrate_scalar(struct State *S, double now, int begin, int end, int *ids, double *times);
+int integrate_avx2(struct State *S, double now, int begin, int end, int *ids, double *times);
+int integrate_avx512(struct State *S, double now, int begin, int end, int *ids, double *times);
+int integrate_exact_scalar(struct State *S, double now, int begin, int end, int *ids, double *times);
+int integrate_exact_avx2(struct State *S, double now, int begin, int end, int *ids, double *times);
+int integrate_exact_avx512(struct State *S, double now, int begin, int end, int *ids, double *times);
+integrate_kernel select_kernel(enum Kernel *k, enum Integrator integrator);
+enum Kernel parse_kernel(const char *s);
+const char *kernel_name(enum Kernel k);
+enum Integrator parse_integrator(const char *s);
+const char *integrator_name(enum Integrator i);
+#endif
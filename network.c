@@ -2,40 +2,54 @@
  * and simple synaptic dynamics 
  *
  *  Dani Martí. Jun 2013  */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "network.h"
 
-gsl_rng *Rng;               /* Global random number generator */
-const gsl_rng_type *Rng_T;  /* Type of rng */
+#ifdef _OPENMP
+#include <omp.h>
+#else
+static inline int omp_get_thread_num(void) { return 0; }
+static inline int omp_get_max_threads(void) { return 1; }
+#endif
 
 void setup_network(struct Network *ntw)
 {
-        ntw->cell = NULL;
+        ntw->cell.V_m = NULL;
+        ntw->cell.I_fast = NULL;
+        ntw->cell.I_slow = NULL;
+        ntw->cell.ref_state = NULL;
+        ntw->history.chunk = NULL;
+        ntw->history.n_chunks = 0;
+        ntw->history.first = NULL;
+        ntw->history.times = NULL;
+        ntw->spike_count = NULL;
+        ntw->synapses.offsets = NULL;
+        ntw->synapses.targets = NULL;
+        ntw->synapses.n_blocks = 0;
+        ntw->synapses.split = NULL;
+        ntw->synapses.map = NULL;
+        ntw->synapses.bytes = NULL;
+        ntw->synapses.byte_offsets = NULL;
+        ntw->synapses.map_size = 0;
+        ntw->synapses.shared = false;
         ntw->ne_spikes = 0;
         ntw->ni_spikes = 0;
         ntw->slow_flag = false;
+        ntw->sampling = SAMPLING_SELECTION;
+        ntw->connectivity = CONNECTIVITY_STORED;
+        ntw->encoding = ENCODING_RAW;
+        ntw->seed = 0;
+        ntw->trial = 0;
+        ntw->first_local = 0;
+        ntw->last_local = 0;
+        ntw->matrix_file[0] = '\0';
 }
 
 
-void setup_rng(void)
-{
-        /* Set up random generator */
-        gsl_rng_env_setup();
-        Rng_T = gsl_rng_default;
-        Rng = gsl_rng_alloc(Rng_T);
-}
-
-/* wrapper to return a standard normal variate */
-double gaussrand()
-{
-        return gsl_ran_gaussian(Rng, 1.0);
-}
-
-/* wrapper to return a uniform variate */
-double uniform()
-{
-        return gsl_rng_uniform(Rng);
-}
-
 void swap(int *a, int *b)
 {
         int tmp = *a;
@@ -43,31 +57,33 @@ void swap(int *a, int *b)
         *b = tmp;
 }
 
-void shuffle(int *v, int n)
+void shuffle(int *v, int n, struct Stream *s)
 {
         double U;
         int k;
         int j = n - 1;
 
         while (j > 0) {
-                U = uniform();
+                U = stream_uniform(s);
                 k = floor(j * U);
                 swap(&v[k], &v[j]);
                 j--;
         }
 }
 
-void sample_without_replacement(int N, int n, int exclude_i, int *v)
+void sample_without_replacement(int N, int n, int exclude_i, int *v,
+                struct Stream *s)
 {
         /* Selection sampling (Knuth 3.4.2). The third argument is the
          * index we want to exclude. This is useful if we want to avoid
-         * autapses. The last argument is a pointer to the array of ints
-         * where we want to store the indices. */
+         * autapses. The fourth argument is a pointer to the array of ints
+         * where we want to store the indices, and the last one the random
+         * stream to draw from. */
         int t = 0; /* total number of input records dealt with*/
         int m = 0; /* number of records selected so far */
 
         while (m < n) {
-                if ((N - t) * uniform() >= n - m || t == exclude_i)
+                if ((N - t) * stream_uniform(s) >= n - m || t == exclude_i)
                         t++;
                 else {
                         v[m] = t;
@@ -77,64 +93,515 @@ void sample_without_replacement(int N, int n, int exclude_i, int *v)
         }
 }
 
-double exponential()
+void sample_without_replacement_floyd(int N, int n, int exclude_i, int *v,
+                struct Stream *s)
+{
+        /* Floyd's algorithm (Bentley & Floyd, CACM 30:754, 1987). Same
+         * arguments as sample_without_replacement, but it costs O(n) random
+         * draws instead of O(N), and the indices are not sorted. Chosen
+         * indices are kept in a small open-addressing hash set. To exclude
+         * an index we sample from the N - 1 others and shift those above it. */
+        int M = N;
+        int shift = 32;
+        unsigned size = 1;
+        unsigned h;
+        int *set;
+        int t, u;
+
+        if (exclude_i >= 0 && exclude_i < N)
+                M--;
+        while (size < 2 * (unsigned) n) {
+                size <<= 1;
+                shift--;
+        }
+        set = emalloc(size * sizeof(int));
+        for (unsigned k = 0; k < size; k++)
+                set[k] = -1;
+
+        for (int m = 0, j = M - n; j < M; j++, m++) {
+                t = (int) ((j + 1) * stream_uniform(s));
+                u = t;
+                /* If t was already chosen, take j instead, which cannot be */
+                h = ((unsigned) t * 2654435761u) >> shift & (size - 1);
+                while (set[h] >= 0) {
+                        if (set[h] == t) {
+                                u = j;
+                                break;
+                        }
+                        h = (h + 1) & (size - 1);
+                }
+                if (u == j) {
+                        h = ((unsigned) j * 2654435761u) >> shift & (size - 1);
+                        while (set[h] >= 0)
+                                h = (h + 1) & (size - 1);
+                }
+                set[h] = u;
+                v[m] = (exclude_i >= 0 && u >= exclude_i) ? u + 1 : u;
+        }
+        free(set);
+}
+
+enum Sampling parse_sampling(const char *s)
+{
+        if (strcmp(s, "selection") == 0)
+                return SAMPLING_SELECTION;
+        else if (strcmp(s, "floyd") == 0)
+                return SAMPLING_FLOYD;
+        report("Unknown sampling method '%s'. Using 'selection'.\n", s);
+        return SAMPLING_SELECTION;
+}
+
+const char *sampling_name(enum Sampling s)
+{
+        return s == SAMPLING_FLOYD ? "floyd" : "selection";
+}
+
+double exponential(struct Stream *s)
 {
         /* Returns an exponential variate with rate 1.
          * For an arbitrary rate r, multiply the output by 1 / r */
-        return -log(uniform());
+        return -log(1.0 - stream_uniform(s));
 }
 
-void allocate_synaptic_structures(struct Network *ntw)
+void allocate_neuron_state(struct Network *ntw)
 {
-        struct Neuron *nrn;
-        double epsilon = (double) ntw->C / (double) ntw->N;
-        int dC = (int) sqrt(ntw->C * (1 - epsilon)) / 2;
+        struct NeuronState *cell = &ntw->cell;
+        cell->V_m = emalloc_aligned(ntw->N * sizeof(real));
+        cell->I_fast = emalloc_aligned(ntw->N * sizeof(real));
+        cell->I_slow = emalloc_aligned(ntw->N * sizeof(real));
+        cell->ref_state = emalloc_aligned(ntw->N * sizeof(int));
+        ntw->history.chunk = NULL;
+        ntw->history.n_chunks = 0;
+        ntw->history.max_chunks = 0;
+        ntw->history.first = emalloc((ntw->N + 1) * sizeof(uint64_t));
+        ntw->history.times = NULL;
+        clear_history(&ntw->history);
+        ntw->spike_count = emalloc(ntw->N * sizeof(unsigned));
+}
 
-        for (int i = 0; i < ntw->N; i++) {
-                nrn = &ntw->cell[i];
-                nrn->synapses.id_innervations = emalloc(ntw->C * sizeof(int));
-                initialize_dynamic_array_projections(&nrn->synapses, ntw->C + 4 * dC);
-        }
+void allocate_synaptic_structures(struct Network *ntw)
+{
+        /* Every neuron receives exactly C connections, so the total number of
+         * synapses is known in advance and no list ever needs to grow. Only
+         * the synapses onto the local neurons are held. */
+        struct SynapticMatrix *m = &ntw->synapses;
+
+        if (ntw->connectivity == CONNECTIVITY_PROCEDURAL)
+                return;
+        m->n_synapses = (size_t) (ntw->last_local - ntw->first_local) * (size_t) ntw->C;
+        m->offsets = emalloc((ntw->N + 1) * sizeof(size_t));
+        m->targets = emalloc(m->n_synapses * sizeof(int));
 }
 
 
 void fill_synaptic_matrix(struct Network *ntw)
 {
         /* Data structures were already created in allocate_synaptic_structures.
-         * Here we only reset counters and generate random indices. */
-        struct Neuron *nrn;
-        int pre_neuron;
+         * Here we only generate random indices and build the projections, in
+         * three passes. The local neurons are split into one contiguous range
+         * of targets per thread. */
+        struct SynapticMatrix *m = &ntw->synapses;
+        int *innervations;
+        int *count;
+        int n_threads = omp_get_max_threads();
+        void (*sample)(int, int, int, int *, struct Stream *) =
+                sample_without_replacement;
+
+        if (ntw->connectivity == CONNECTIVITY_PROCEDURAL)
+                return;
+        if (ntw->sampling == SAMPLING_FLOYD)
+                sample = sample_without_replacement_floyd;
+
+        innervations = emalloc(m->n_synapses * sizeof(int));
+        /* count[t * N + j]: projections of j onto the targets of thread t */
+        count = emalloc((size_t) n_threads * ntw->N * sizeof(int));
+
+#pragma omp parallel num_threads(n_threads)
+        {
+                int t = omp_get_thread_num();
+                int n_local = ntw->last_local - ntw->first_local;
+                int first = ntw->first_local + (int) ((long) n_local * t / n_threads);
+                int last = ntw->first_local + (int) ((long) n_local * (t + 1) / n_threads);
+                int *mine = count + (size_t) t * ntw->N;
+                int *inn;
+
+                /* 1. Sample the innervations of each target and count, per
+                 * thread, the projections of each source. The innervations of
+                 * each neuron are drawn from a stream of its own, so the
+                 * network depends on the seed only, not on the number of
+                 * threads. */
+                for (int j = 0; j < ntw->N; j++)
+                        mine[j] = 0;
+                for (int i = first; i < last; i++) {
+                        struct Stream s;
+                        inn = innervations + (size_t) (i - ntw->first_local) * ntw->C;
+                        stream_init(&s, ntw->seed, i, STREAM_INNERVATIONS, 0);
+                        /* Of the C innervations, C * f are excitatory */
+                        sample(ntw->NE, ntw->CE, i, inn, &s);
+                        /* ... and C * (1 - f) are inhibitory  */
+                        sample(ntw->NI, ntw->CI, i - ntw->NE, inn + ntw->CE, &s);
+                        /* add the offset for inhibitory neurons */
+                        for (int j = 0; j < ntw->CI; j++)
+                                inn[ntw->CE + j] += ntw->NE;
+                        for (int j = 0; j < ntw->C; j++)
+                                mine[inn[j]]++;
+                }
+#pragma omp barrier
+
+                /* 2. Sesame street: if i is innervated by j, then j projects
+                 * to i. Turn the counts into the position of each thread
+                 * within each row ... */
+#pragma omp for schedule(static)
+                for (int j = 0; j < ntw->N; j++) {
+                        int n = 0, c;
+                        for (int u = 0; u < n_threads; u++) {
+                                c = count[(size_t) u * ntw->N + j];
+                                count[(size_t) u * ntw->N + j] = n;
+                                n += c;
+                        }
+                        m->offsets[j + 1] = n;
+                }
+#pragma omp single
+                {
+                        m->offsets[0] = 0;
+                        for (int j = 0; j < ntw->N; j++)
+                                m->offsets[j + 1] += m->offsets[j];
+                }
+
+                /* 3. ... and place the projections. Each thread writes its
+                 * own slice of every row, scanning its targets in increasing
+                 * order, so rows come out sorted. */
+                for (int i = first; i < last; i++) {
+                        inn = innervations + (size_t) (i - ntw->first_local) * ntw->C;
+                        for (int j = 0; j < ntw->C; j++)
+                                m->targets[m->offsets[inn[j]] + mine[inn[j]]++] = i;
+                }
+        }
+        free(count);
+        free(innervations);
+}
+
+/* Layout of a connectivity file: this header, then the N + 1 offsets,
+ * then the targets, all in native byte order. The checksum covers offsets
+ * and targets. */
+struct MatrixFileHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t N;
+        int32_t NE;
+        int32_t C;
+        int32_t CE;
+        int32_t sampling;
+        uint64_t seed;
+        uint64_t n_synapses;
+        uint64_t checksum;
+};
+
+static const char matrix_magic[8] = "LIFCONN";
+#define MATRIX_FILE_VERSION 1
+
+uint64_t fnv_checksum(const void *p, size_t n, uint64_t h)
+{
+        /* FNV-1a on 64-bit words, and on single bytes for the tail */
+        const unsigned char *b = p;
+        uint64_t w;
+        size_t k = 0;
+
+        for (; k + 8 <= n; k += 8) {
+                memcpy(&w, b + k, 8);
+                h = (h ^ w) * 0x100000001b3ULL;
+        }
+        for (; k < n; k++)
+                h = (h ^ b[k]) * 0x100000001b3ULL;
+        return h;
+}
+
+static void fill_matrix_header(const struct Network *ntw, struct MatrixFileHeader *h)
+{
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, matrix_magic, sizeof(h->magic));
+        h->version = MATRIX_FILE_VERSION;
+        h->N = ntw->N;
+        h->NE = ntw->NE;
+        h->C = ntw->C;
+        h->CE = ntw->CE;
+        h->sampling = ntw->sampling;
+        h->seed = ntw->seed;
+}
+
+int save_synaptic_matrix(const struct Network *ntw, const char *path)
+{
+        /* Write the synaptic matrix to path. The file is written under a
+         * temporary name and then renamed, so concurrent runs never see
+         * it half written. Returns 0 on success. */
+        const struct SynapticMatrix *m = &ntw->synapses;
+        struct MatrixFileHeader h;
+        char tmp[MAX_PATH_LENGTH + 32];
+        FILE *f;
+        int ok;
+
+        fill_matrix_header(ntw, &h);
+        h.n_synapses = m->n_synapses;
+        h.checksum = fnv_checksum(m->offsets, (ntw->N + 1) * sizeof(size_t),
+                        0xcbf29ce484222325ULL);
+        h.checksum = fnv_checksum(m->targets, m->n_synapses * sizeof(int),
+                        h.checksum);
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long) getpid());
+        if ((f = fopen(tmp, "wb")) == NULL) {
+                weprintf("cannot write connectivity file '%s':", tmp);
+                return -1;
+        }
+        ok = fwrite(&h, sizeof(h), 1, f) == 1
+                && fwrite(m->offsets, sizeof(size_t), ntw->N + 1, f) == (size_t) ntw->N + 1
+                && fwrite(m->targets, sizeof(int), m->n_synapses, f) == m->n_synapses;
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmp, path) != 0) {
+                weprintf("cannot write connectivity file '%s':", path);
+                remove(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+int load_synaptic_matrix(struct Network *ntw, const char *path)
+{
+        /* Map the synaptic matrix saved in path, read-only and shared, so
+         * that all processes using the same file share one copy in the page
+         * cache. Returns 0 on success, and -1 if the file does not exist or
+         * was built for another network. */
+        struct SynapticMatrix *m = &ntw->synapses;
+        struct MatrixFileHeader expected;
+        const struct MatrixFileHeader *h;
+        struct stat st;
+        char *base;
+        void *map;
+        size_t size;
+        uint64_t sum;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY)) < 0) {
+                if (errno != ENOENT)
+                        weprintf("cannot open connectivity file '%s':", path);
+                return -1;
+        }
+        if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*h)) {
+                report("'%s' is not a connectivity file. It will be rebuilt.\n", path);
+                close(fd);
+                return -1;
+        }
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                weprintf("cannot map connectivity file '%s':", path);
+                return -1;
+        }
+
+        h = map;
+        fill_matrix_header(ntw, &expected);
+        expected.n_synapses = h->n_synapses;
+        expected.checksum = h->checksum;
+        if (memcmp(h, &expected, sizeof(expected)) != 0
+                        || size != sizeof(*h) + (ntw->N + 1) * sizeof(size_t)
+                        + h->n_synapses * sizeof(int)) {
+                report("'%s' was built for a different network. It will be rebuilt.\n", path);
+                munmap(map, size);
+                return -1;
+        }
+        base = (char *) map + sizeof(*h);
+        sum = fnv_checksum(base, size - sizeof(*h), 0xcbf29ce484222325ULL);
+        if (sum != h->checksum) {
+                report("'%s' is corrupt. It will be rebuilt.\n", path);
+                munmap(map, size);
+                return -1;
+        }
+
+        m->map = map;
+        m->map_size = size;
+        m->n_synapses = h->n_synapses;
+        m->offsets = (size_t *) base;
+        m->targets = (int *) (base + (ntw->N + 1) * sizeof(size_t));
+        return 0;
+}
+
+void split_synaptic_matrix(struct Network *ntw, int n_blocks, const int *bounds)
+{
+        /* Split every row of the synaptic matrix into n_blocks pieces, the
+         * b-th one holding the targets in bounds[b], ..., bounds[b + 1] - 1.
+         * Rows are sorted, so each split point is found by bisection. This
+         * must be done before the matrix is compressed. */
+        struct SynapticMatrix *m = &ntw->synapses;
+        int stride = n_blocks + 1;
+
+        free(m->split);
+        m->n_blocks = n_blocks;
+        m->split = NULL;
+        if (ntw->connectivity == CONNECTIVITY_PROCEDURAL)
+                return;
+        m->split = emalloc((size_t) ntw->N * stride * sizeof(int));
+
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < ntw->N; i++) {
+                const int *row = m->targets + m->offsets[i];
+                int len = (int) (m->offsets[i + 1] - m->offsets[i]);
+                int lo, hi, mid;
+                for (int b = 0; b < stride; b++) {
+                        lo = 0;
+                        hi = len;
+                        while (lo < hi) {
+                                mid = (lo + hi) / 2;
+                                if (row[mid] < bounds[b])
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
+                        }
+                        m->split[(size_t) i * stride + b] = lo;
+                }
+        }
+}
 
-        int C_exc = rint(ntw->C * ((double) ntw->NE / (double) ntw->N));
-        int C_inh = rint(ntw->C * ((double) ntw->NI / (double) ntw->N));
+static int varint_length(unsigned v)
+{
+        int n = 1;
 
-        /* report("\n  Generating synaptic matrix... "); */
-        /* fflush(stdout); */
+        while (v >= 128) {
+                v >>= 7;
+                n++;
+        }
+        return n;
+}
 
-        /* Reset projection counter. Remember that id_projections is a dynamic
-         * array, so we don't need to do anything else. */
+static uint8_t *put_varint(uint8_t *q, unsigned v)
+{
+        while (v >= 128) {
+                *q++ = (uint8_t) (v | 128);
+                v >>= 7;
+        }
+        *q++ = (uint8_t) v;
+        return q;
+}
+
+void compress_synaptic_matrix(struct Network *ntw, const int *bounds)
+{
+        /* Re-encode the rows of a split synaptic matrix as varints (see
+         * struct SynapticMatrix). Each block is encoded relative to its first
+         * neuron, bounds[b], so that it can be decoded on its own. First
+         * measure every row, then encode it. */
+        struct SynapticMatrix *m = &ntw->synapses;
+        int stride = m->n_blocks + 1;
+
+        if (ntw->connectivity == CONNECTIVITY_PROCEDURAL)
+                return;
+        m->byte_offsets = emalloc((ntw->N + 1) * sizeof(size_t));
+
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < ntw->N; i++) {
+                const int *row = m->targets + m->offsets[i];
+                const int *split = m->split + (size_t) i * stride;
+                size_t n = 0;
+                for (int b = 0; b < m->n_blocks; b++) {
+                        int prev = bounds[b];
+                        for (int k = split[b]; k < split[b + 1]; k++) {
+                                n += varint_length(row[k] - prev);
+                                prev = row[k];
+                        }
+                }
+                m->byte_offsets[i + 1] = n;
+        }
+        m->byte_offsets[0] = 0;
         for (int i = 0; i < ntw->N; i++)
-                ntw->cell[i].synapses.id_projections.n = 0; 
-
-        for (size_t i = 0; i < (size_t)ntw->N; i++) {
-                nrn = &ntw->cell[i];
-                /* For the nrn->synapses.id_innervations, we just replace the C
-                 * random indices for each neuron. */
-                /* Of the C innervations, C * f are excitatory */
-                sample_without_replacement(ntw->NE, C_exc, i, nrn->synapses.id_innervations);
-                /* ... and C * (1 - f) are inhibitory  */
-                sample_without_replacement(ntw->NI, C_inh, i - ntw->NE, nrn->synapses.id_innervations + C_exc);
-                /* add the offset for inhibitory neurons */
-                for (int j = 0; j < C_inh; j++)
-                        nrn->synapses.id_innervations[C_exc + j] += ntw->NE;
-                /* Sesame street: if i is innervated by j, then j projects to
-                 * i. We need to build the list of projections for each
-                 * neuron---going reverse */
-                for (int j = 0; j < ntw->C; j++) { 
-                        pre_neuron = nrn->synapses.id_innervations[j];
-                        push_innervation(&ntw->cell[pre_neuron].synapses, i);
+                m->byte_offsets[i + 1] += m->byte_offsets[i];
+        m->bytes = emalloc(m->byte_offsets[ntw->N] + 1);
+
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < ntw->N; i++) {
+                const int *row = m->targets + m->offsets[i];
+                int *split = m->split + (size_t) i * stride;
+                uint8_t *start = m->bytes + m->byte_offsets[i];
+                uint8_t *q = start;
+                int first = split[0];
+                for (int b = 0; b < m->n_blocks; b++) {
+                        int prev = bounds[b];
+                        int last = split[b + 1];
+                        /* From now on, split holds offsets in bytes */
+                        split[b] = (int) (q - start);
+                        for (int k = first; k < last; k++) {
+                                q = put_varint(q, row[k] - prev);
+                                prev = row[k];
+                        }
+                        first = last;
                 }
+                split[m->n_blocks] = (int) (q - start);
+        }
+
+        /* The raw targets are no longer needed */
+        if (m->map == NULL)
+                free(m->targets);
+        m->targets = NULL;
+}
+
+enum Encoding parse_encoding(const char *s)
+{
+        if (strcmp(s, "raw") == 0)
+                return ENCODING_RAW;
+        else if (strcmp(s, "varint") == 0)
+                return ENCODING_VARINT;
+        report("Unknown encoding '%s'. Using 'raw'.\n", s);
+        return ENCODING_RAW;
+}
+
+const char *encoding_name(enum Encoding e)
+{
+        return e == ENCODING_VARINT ? "varint" : "raw";
+}
+
+int procedural_targets(const struct Network *ntw, int source, int block, int *targets)
+{
+        /* Regenerate the targets of neuron source among neurons
+         * block * PROCEDURAL_BLOCK, ..., (block + 1) * PROCEDURAL_BLOCK - 1,
+         * and return how many there are. Each neuron is a target with
+         * probability CE / NE if the source is excitatory, and CI / NI if it
+         * is inhibitory, so on average every neuron receives CE excitatory
+         * and CI inhibitory connections, as with the stored matrix (although
+         * the number is not fixed). The gaps between consecutive targets are
+         * geometric, so the cost is proportional to the number of targets. */
+        struct Stream s;
+        int first = block * PROCEDURAL_BLOCK;
+        int last = first + PROCEDURAL_BLOCK < ntw->N ? first + PROCEDURAL_BLOCK : ntw->N;
+        double p = source < ntw->NE ? (double) ntw->CE / ntw->NE : (double) ntw->CI / ntw->NI;
+        double log_q = log(1.0 - p);
+        double gap;
+        int i = first - 1;
+        int n = 0;
+
+        if (p <= 0)
+                return 0;
+        stream_init(&s, ntw->seed, source, STREAM_PROJECTIONS, block);
+        for (;;) {
+                gap = floor(log(1.0 - stream_uniform(&s)) / log_q);
+                if (gap >= last - 1 - i)
+                        break;
+                i += 1 + (int) gap;
+                if (i != source)
+                        targets[n++] = i;
         }
+        return n;
+}
+
+enum Connectivity parse_connectivity(const char *s)
+{
+        if (strcmp(s, "stored") == 0)
+                return CONNECTIVITY_STORED;
+        else if (strcmp(s, "procedural") == 0)
+                return CONNECTIVITY_PROCEDURAL;
+        report("Unknown connectivity '%s'. Using 'stored'.\n", s);
+        return CONNECTIVITY_STORED;
+}
+
+const char *connectivity_name(enum Connectivity c)
+{
+        return c == CONNECTIVITY_PROCEDURAL ? "procedural" : "stored";
 }
 
 void initialize_table_of_spikes (struct Network *ntw, int lag)
@@ -145,131 +612,232 @@ void initialize_table_of_spikes (struct Network *ntw, int lag)
         t->i_curr = lag; /* the current time is a few indices ahead */
         t->lag = lag;
         t->size = lag + 1; /* the  size of the buffer */
+        /* No more than N neurons can fire in a time step */
+        t->capacity = ntw->N < INITIAL_SPIKES_PER_DT ? ntw->N : INITIAL_SPIKES_PER_DT;
+        if (t->capacity < 1)
+                t->capacity = 1;
         /* spikes emitted at each time slot */
         t->num_spikes = emalloc(t->size * sizeof(int)); 
         /* indices of the neurons that emitted spikes at a particular time slot */
         t->indices = emalloc(t->size * sizeof(int*));
+        t->arena = emalloc((size_t) t->size * t->capacity * sizeof(int));
         for (int i = 0; i < t->size; i++) {
                 t->num_spikes[i] = 0;
-                t->indices[i] = emalloc(MAX_SPIKES_PER_DT  * sizeof(int));
+                t->indices[i] = t->arena + (size_t) i * t->capacity;
+        }
+}
+
+void grow_table_of_spikes(struct TableNSpikes *t, int n, int N)
+{
+        /* Make room for n spikes per slot, at least doubling the capacity
+         * (but never beyond N) so that growth happens only a few times per
+         * run. The spikes already stored are kept. */
+        int capacity = t->capacity;
+        int *arena;
+
+        while (capacity < n)
+                capacity *= 2;
+        if (capacity > N)
+                capacity = N;
+        arena = emalloc((size_t) t->size * capacity * sizeof(int));
+        for (int i = 0; i < t->size; i++) {
+                memcpy(arena + (size_t) i * capacity, t->indices[i],
+                                t->num_spikes[i] * sizeof(int));
+                t->indices[i] = arena + (size_t) i * capacity;
         }
+        free(t->arena);
+        t->arena = arena;
+        t->capacity = capacity;
 }
 
-void initialize_individual_spike_train(struct Neuron *nrn)
+void free_table_of_spikes(struct TableNSpikes *t)
+{
+        free(t->num_spikes);
+        free(t->indices);
+        free(t->arena);
+}
+
+void init_dynamic_array(struct Dynamic_Array *a)
 {
-        struct Dynamic_Array *a;
-        a = &nrn->spike_train;
         a->n = 0;
-        a->size = 1000;    /* educated guess 100 Hz per neuron and 10 s of simulation*/
+        a->size = 1000;    /* doubled by push_value as needed */
         a->data = emalloc(a->size * sizeof(double));
 }
 
-void initialize_dynamic_array_projections(struct ConnectionSet *cnn, int Cbroad)
+void add_history_chunk(struct SpikeHistory *h)
 {
-        struct Projection_array *a;
-        a = &cnn->id_projections;
-        a->n = 0;
-        a->size = Cbroad;
-        a->data = emalloc(a->size * sizeof(int));
+        /* Make room for HISTORY_CHUNK more spikes. Chunks are kept when the
+         * history is cleared, and used again. */
+        if (h->n_chunks == h->max_chunks) {
+                h->max_chunks = h->max_chunks > 0 ? 2 * h->max_chunks : 16;
+                h->chunk = erealloc(h->chunk, h->max_chunks * sizeof(struct SpikeEvent *));
+        }
+        h->chunk[h->n_chunks++] = emalloc(HISTORY_CHUNK * sizeof(struct SpikeEvent));
+}
+
+void clear_history(struct SpikeHistory *h)
+{
+        h->n = 0;
+        h->indexed = false;
+}
+
+void index_history(struct Network *ntw)
+{
+        /* Sort the spikes of the history by neuron, keeping their order, so
+         * that the spike train of every neuron is contiguous, in the layout
+         * of a spike archive (see spikearchive.h). Nothing is done if the
+         * index is up to date. */
+        struct SpikeHistory *h = &ntw->history;
+        const struct SpikeEvent *e;
+        uint64_t *next;
+
+        if (h->indexed)
+                return;
+        for (int i = 0; i <= ntw->N; i++)
+                h->first[i] = 0;
+        for (size_t k = 0; k < h->n; k++)
+                h->first[h->chunk[k / HISTORY_CHUNK][k % HISTORY_CHUNK].id + 1]++;
+        for (int i = 0; i < ntw->N; i++)
+                h->first[i + 1] += h->first[i];
+        free(h->times);
+        h->times = emalloc((h->n > 0 ? h->n : 1) * sizeof(double));
+        next = emalloc(ntw->N * sizeof(uint64_t));
+        memcpy(next, h->first, ntw->N * sizeof(uint64_t));
+        for (size_t k = 0; k < h->n; k++) {
+                e = &h->chunk[k / HISTORY_CHUNK][k % HISTORY_CHUNK];
+                h->times[next[e->id]++] = e->time;
+        }
+        free(next);
+        h->indexed = true;
+}
+
+void free_history(struct SpikeHistory *h)
+{
+        for (int c = 0; c < h->n_chunks; c++)
+                free(h->chunk[c]);
+        free(h->chunk);
+        free(h->first);
+        free(h->times);
+}
+
+static void initialize_spike_trains(struct Network *ntw)
+{
+        for (int i = 0; i < ntw->N; i++)
+                ntw->spike_count[i] = 0;
+        clear_history(&ntw->history);
 }
 
 void initialize_individual_vars_for_neurons(struct Network *ntw)
 {
-        struct Neuron *nrn;
+        initialize_spike_trains(ntw);
+        draw_initial_state(ntw);
+}
+
+void draw_initial_state(struct Network *ntw)
+{
+        /* Draw the initial conditions of the current trial. Every trial has
+         * its own substream, so trial 0 starts as a single run does. */
+        struct NeuronState *cell = &ntw->cell;
         /* We initialize the current assuming that nu_0 = 10Hz */
         double stdI = ntw->J * sqrt(ntw->CE * ntw->tau_m * 0.01 * (1 + pow(ntw->g, 2) * 0.8));
 
-        for (int i = 0; i < ntw->N; i++) {
-                nrn = & ntw->cell[i];
-                if (uniform() < 0.2) {
-                        nrn->ref_state = (int) ntw->top_ref_state * uniform();
-                        nrn->V_m = V_reset;
+#pragma omp parallel for schedule(static)
+        for (int i = ntw->first_local; i < ntw->last_local; i++) {
+                struct Stream s;
+                stream_init(&s, ntw->seed, i, STREAM_INITIAL_STATE, ntw->trial);
+                if (stream_uniform(&s) < 0.2) {
+                        cell->ref_state[i] = (int) ntw->top_ref_state * stream_uniform(&s);
+                        cell->V_m[i] = V_reset;
                 } else {
-                        nrn->ref_state = 0;
+                        cell->ref_state[i] = 0;
                         /* Distribute uniformly between reset and threshold potentials */
-                        nrn->V_m = V_reset + (V_thr - V_reset) * uniform();
+                        cell->V_m[i] = V_reset + (V_thr - V_reset) * stream_uniform(&s);
                 }
-                nrn->I_fast = stdI * gaussrand();
+                cell->I_fast[i] = stdI * stream_gaussian(&s);
                 if (ntw->slow_flag)
-                        nrn->I_slow = stdI * gaussrand();
+                        cell->I_slow[i] = stdI * stream_gaussian(&s);
                 else
-                        nrn->I_slow = 0;
-                initialize_individual_spike_train(nrn);
+                        cell->I_slow[i] = 0;
         }
 }
 
-double euler (struct Network *ntw, struct Neuron *nrn, double V)
+void clone_network(struct Network *dst, const struct Network *src)
 {
-        return (-V  + ntw->ext_current + nrn->I_fast + nrn->I_slow) / ntw->tau_m;
+        /* Make dst a network with the parameters and the synaptic matrix of
+         * src, but with a state of its own, so that several trials can run
+         * at once on the same connectivity. The matrix is only read during
+         * a trial; src keeps ownership and must outlive dst. The state is
+         * not initialized: see draw_initial_state. */
+        *dst = *src;
+        dst->synapses.shared = true;
+        dst->ne_spikes = 0;
+        dst->ni_spikes = 0;
+        allocate_neuron_state(dst);
+        initialize_table_of_spikes(dst, src->tab_spikes.lag);
+        initialize_spike_trains(dst);
 }
 
 void free_network(struct Network *ntw)
 {
-        for (int i = 0; i < ntw->N; i++) {
-                free(ntw->cell[i].synapses.id_innervations);
-                free(ntw->cell[i].synapses.id_projections.data);
-                free(ntw->cell[i].spike_train.data);
+        free_history(&ntw->history);
+        free(ntw->spike_count);
+        /* Free the synaptic matrix, unless it belongs to another network */
+        if (!ntw->synapses.shared) {
+                if (ntw->synapses.map != NULL) {
+                        munmap(ntw->synapses.map, ntw->synapses.map_size);
+                } else {
+                        free(ntw->synapses.offsets);
+                        free(ntw->synapses.targets);
+                }
+                free(ntw->synapses.split);
+                free(ntw->synapses.bytes);
+                free(ntw->synapses.byte_offsets);
         }
         /* Free the table of spikes */
-        free(ntw->tab_spikes.num_spikes);
-        for (int i = 0; i < ntw->tab_spikes.size; i++) {
-                free(ntw->tab_spikes.indices[i]);
-        }
-        free(ntw->tab_spikes.indices);
-
-        /* Free the array of neurons and contents */
-        free(ntw->cell);
-}
-
-void free_rng(void) 
-{
-        gsl_rng_free(Rng);
-}
-
-
-void push_innervation(struct ConnectionSet *cnn, size_t i)
-{
-        /* neuron i is innervated by j, therefore j projects to i */
-        struct Projection_array *a;
-        a = &cnn->id_projections;
-        int *b;
+        free_table_of_spikes(&ntw->tab_spikes);
 
-        if(a->n >= a->size) { /* grow */
-                b = erealloc(a->data, (a->size + 1000) * sizeof(size_t));
-                a->size += 1000;
-                a->data = b;
-        }
-        a->data[a->n] = i;
-        a->n++;
+        /* Free the state of the neurons */
+        free(ntw->cell.V_m);
+        free(ntw->cell.I_fast);
+        free(ntw->cell.I_slow);
+        free(ntw->cell.ref_state);
 }
 
-void push_spike(struct Neuron *nrn, double spike_time)
+void push_value(struct Dynamic_Array *a, double value)
 {
-        struct Dynamic_Array *a;
         double *b;
 
-        a = &nrn->spike_train;
-
         if(a->n >= a->size) { /* grow */
                 b = erealloc(a->data, 2 * a->size * sizeof(double));
                 a->size *= 2;
                 a->data = b;
         }
-        a->data[a->n] = spike_time;
+        a->data[a->n] = value;
         a->n++;
 }
 
-void save_pdfs_synaptic_vars(struct Network *ntw)
+double membrane_response(double t, double tau, double tau_m)
 {
-        struct Neuron *nrn;
+        /* Membrane potential at time t, starting from 0, driven by a
+         * synaptic current of unit size at t = 0 that decays with time
+         * constant tau. Solves tau_m dV/dt = -V + exp(-t / tau). */
+        if (fabs(tau - tau_m) < 1e-9 * tau_m)
+                return t / tau_m * exp(-t / tau_m);
+        return tau / (tau - tau_m) * (exp(-t / tau) - exp(-t / tau_m));
+}
+
+void save_pdfs_synaptic_vars(struct Network *ntw, const char *filename)
+{
+        /* The variables of the local neurons. The processes of a distributed
+         * run append theirs in turn. */
+        struct NeuronState *cell = &ntw->cell;
         FILE *f;
 
-        f = fopen("synaptic_variables_at_end.dat", "w");
+        f = fopen(filename, ntw->first_local == 0 ? "w" : "a");
 
-        for (int i = 0; i < ntw->N; i++) {
-                nrn = &ntw->cell[i];
+        for (int i = ntw->first_local; i < ntw->last_local; i++) {
                 fprintf(f, "% 8.4e % 8.5e % 8.5e\n", 
-                                nrn->V_m, nrn->I_fast, nrn->I_slow);
+                                cell->V_m[i], cell->I_fast[i], cell->I_slow[i]);
         }
         fclose(f);
 }
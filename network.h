@@ -6,12 +6,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_randist.h>
 #include "parameters.h"
 #include "eprintf.h"
+#include "rng.h"
 
-#define MAX_SPIKES_PER_DT 4000
+/* Initial capacity of each slot of the table of spikes. The table grows
+ * when a time step produces more spikes. */
+#define INITIAL_SPIKES_PER_DT 4000
 
 struct TableNSpikes {
         /* The following vector is a sort of circular buffer that stores the number
@@ -20,6 +21,10 @@ struct TableNSpikes {
         int size;
         int *num_spikes; /* number of spikes emitted at a particular time */
         int **indices;      /* indices of the neurons that have emitted a spike */
+        /* All slots live in a single arena: slot i starts at
+         * arena + i * capacity */
+        int capacity;
+        int *arena;
         /* Number of positions between past and present */
         int lag;
         /* index pointing where we are now in time  */ 
@@ -35,31 +40,101 @@ struct Dynamic_Array {
         double *data;
 };
 
-struct Projection_array {
+/* A spike of the history: its time and the neuron that emitted it */
+struct SpikeEvent {
+        double time;
+        int id;
+};
+
+/* Spike events per chunk of the history */
+#define HISTORY_CHUNK 16384
+
+struct SpikeHistory {
+        /* Spikes of the analyzed neurons, appended in the order they are
+         * emitted to a log of chunks of HISTORY_CHUNK events. All chunks
+         * but the last are full; they are never moved once allocated. */
+        struct SpikeEvent **chunk;
+        int n_chunks;
+        int max_chunks;
         size_t n;
-        size_t size;
-        int *data;
+        /* Index of the log by neuron, built on demand (see index_history):
+         * the spike times of neuron i are times[first[i]], ...,
+         * times[first[i + 1] - 1], in order */
+        uint64_t *first;        /* N + 1 entries */
+        double *times;
+        bool indexed;
 };
 
-struct ConnectionSet {
-        /* indices of neurons projecting to the neuron */
-        int *id_innervations;
-        /* indices of neurons innervated by the neuron */
-        struct Projection_array id_projections;
+struct SynapticMatrix {
+        /* Projections of all neurons in compressed sparse row format. The
+         * neurons innervated by neuron i are targets[offsets[i]], ...,
+         * targets[offsets[i + 1] - 1], in increasing order. */
+        size_t n_synapses;
+        size_t *offsets;   /* N + 1 entries */
+        int *targets;      /* n_synapses entries */
+        /* Partition of each row by blocks of targets, for parallel delivery.
+         * The targets of neuron i that lie in block b are those between
+         * offsets[i] + split[i * (n_blocks + 1) + b] and
+         * offsets[i] + split[i * (n_blocks + 1) + b + 1]. */
+        int n_blocks;
+        int *split;
+        /* With ENCODING_VARINT, each row is also stored compressed in bytes,
+         * starting at bytes + byte_offsets[i]. Within block b, the first
+         * target is stored as its distance from the first neuron of the
+         * block, and every other target as its distance from the previous
+         * one, all as LEB128 varints (7 bits per byte, high bit set on all
+         * bytes but the last). split then holds, for every block, its offset
+         * in bytes from the start of the row, and targets is not kept. */
+        uint8_t *bytes;
+        size_t *byte_offsets;   /* N + 1 entries */
+        /* If offsets and targets were mapped from a file, the mapping;
+         * otherwise NULL */
+        void *map;
+        size_t map_size;
+        /* Whether the arrays belong to another network (see clone_network),
+         * which frees them */
+        bool shared;
 };
 
-struct Neuron {
-        double V_m;              /* membrane potential (in mV) */
-        int ref_state;           /* counter for refractoriness */
-        double I_fast;                /* fast current */
-        double I_slow;                /* slow current */
-        /* data relative to fast and slow synapses. We use the same
-         * connectivity matrix for both */
-        struct ConnectionSet synapses;
-        /* Dynamic array of the individual spike train */
-        struct Dynamic_Array spike_train;
+/* Type of the dynamical variables of the neurons. Building with
+ * -DSINGLE_PRECISION stores and updates them in single precision, which
+ * halves the memory traffic of the update and doubles the SIMD width.
+ * Spike times and everything else stay in double precision. */
+#ifdef SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
+struct NeuronState {
+        /* Dynamical variables of all neurons, stored as a structure of
+         * arrays: the membrane update streams through each array and touches
+         * nothing else. Every array has N entries and is cache-line aligned. */
+        real *V_m;               /* membrane potentials (in mV) */
+        real *I_fast;            /* fast currents */
+        real *I_slow;            /* slow currents */
+        int *ref_state;          /* counters for refractoriness */
 };
 
+/* Methods to draw the presynaptic partners of each neuron */
+enum Sampling { SAMPLING_SELECTION, SAMPLING_FLOYD };
+
+/* Connectivity can be stored in the synaptic matrix, or regenerated from a
+ * random stream every time a neuron spikes (procedural connectivity) */
+enum Connectivity { CONNECTIVITY_STORED, CONNECTIVITY_PROCEDURAL };
+
+/* How the stored synaptic matrix is held in memory */
+enum Encoding {
+        ENCODING_RAW,           /* one int per synapse */
+        ENCODING_VARINT         /* delta-encoded varints, see SynapticMatrix */
+};
+
+/* With procedural connectivity, the targets of a neuron are generated in
+ * blocks of this many consecutive neurons, each from its own stream */
+#define PROCEDURAL_BLOCK 4096
+
+#define MAX_PATH_LENGTH 256
+
 struct Network {
         int N;
         int NE; /* Number of excitatory cells */
@@ -69,6 +144,18 @@ struct Network {
         int C;  /* Number of connections per neuron (fixed!) */
         int CE; /* Number of excitatory connections per neuron */
         int CI; /* ... and of inhibitory congections per neuron */
+        enum Sampling sampling; /* how connections are drawn */
+        enum Connectivity connectivity;
+        enum Encoding encoding;
+        unsigned long seed; /* seed of the counter-based random streams */
+        int trial; /* trial number, which selects the initial conditions */
+        /* Neurons whose state and incoming synapses this process holds:
+         * all of them, unless the network is distributed over several
+         * processes (see distributed.c) */
+        int first_local;
+        int last_local;
+        /* File where the synaptic matrix is cached, or empty */
+        char matrix_file[MAX_PATH_LENGTH];
         double tau_m;
         double tau_slow; /* Slow synaptic time constant */
         double tau_fast; /* Slow synaptic time constant */
@@ -80,7 +167,15 @@ struct Network {
 
         double ext_current;
 
-        struct Neuron *cell;        /* Pointer to the array of neurons */
+        struct NeuronState cell;    /* State of the neurons */
+
+        /* Spikes of the neurons analyzed at the end of a run (see
+         * keeps_train). Every neuron counts its spikes after the offset. */
+        struct SpikeHistory history;
+        unsigned *spike_count;
+
+        /* Connectivity. We use the same matrix for fast and slow synapses */
+        struct SynapticMatrix synapses;
 
         /* Table of spikes */
         struct TableNSpikes tab_spikes;
@@ -92,21 +187,92 @@ struct Network {
 
 /* network.c */
 void setup_network(struct Network *ntw);
-void setup_rng(void);
-double gaussrand(void);
-double uniform(void);
-void sample_without_replacement(int N, int n, int exclude_i, int *v);
-double exponential(void);
+void sample_without_replacement(int N, int n, int exclude_i, int *v,
+                struct Stream *s);
+void sample_without_replacement_floyd(int N, int n, int exclude_i, int *v,
+                struct Stream *s);
+enum Sampling parse_sampling(const char *s);
+const char *sampling_name(enum Sampling s);
+double exponential(struct Stream *s);
+void allocate_neuron_state(struct Network *ntw);
 void allocate_synaptic_structures(struct Network *ntw);
 void fill_synaptic_matrix(struct Network *ntw);
+int save_synaptic_matrix(const struct Network *ntw, const char *path);
+int load_synaptic_matrix(struct Network *ntw, const char *path);
+void split_synaptic_matrix(struct Network *ntw, int n_blocks, const int *bounds);
+void compress_synaptic_matrix(struct Network *ntw, const int *bounds);
+enum Encoding parse_encoding(const char *s);
+const char *encoding_name(enum Encoding e);
+int procedural_targets(const struct Network *ntw, int source, int block, int *targets);
+enum Connectivity parse_connectivity(const char *s);
+const char *connectivity_name(enum Connectivity c);
 void initialize_table_of_spikes(struct Network *ntw, int lag);
-void vidual_spike_train(struct Neuron *nrn);
-void initialize_dynamic_array_projections(struct ConnectionSet *cnn, int Cbroad);
+void grow_table_of_spikes(struct TableNSpikes *t, int n, int N);
+void free_table_of_spikes(struct TableNSpikes *t);
+void init_dynamic_array(struct Dynamic_Array *a);
+void add_history_chunk(struct SpikeHistory *h);
+void clear_history(struct SpikeHistory *h);
+void index_history(struct Network *ntw);
+void free_history(struct SpikeHistory *h);
+uint64_t fnv_checksum(const void *p, size_t n, uint64_t h);
 void initialize_individual_vars_for_neurons(struct Network *ntw);
-double euler(struct Network *ntw, struct Neuron *nrn, double V);
+void draw_initial_state(struct Network *ntw);
+void clone_network(struct Network *dst, const struct Network *src);
 void free_network(struct Network *ntw);
-void free_rng(void);
-void push_innervation(struct ConnectionSet *cnn, size_t i);
-void push_spike(struct Neuron *nrn, double spike_time);
-void save_pdfs_synaptic_vars(struct Network *ntw);
+void push_value(struct Dynamic_Array *a, double value);
+void save_pdfs_synaptic_vars(struct Network *ntw, const char *filename);
+double membrane_response(double t, double tau, double tau_m);
+
+/* Decode the varint at q into *v, and return a pointer past it */
+static inline const uint8_t *get_varint(const uint8_t *q, unsigned *v)
+{
+        unsigned d = *q++;
+        unsigned b, shift = 7;
+
+        if (d >= 128) {
+                d &= 127;
+                do {
+                        b = *q++;
+                        d |= (b & 127) << shift;
+                        shift += 7;
+                } while (b >= 128);
+        }
+        *v = d;
+        return q;
+}
+
+/* Neurons analyzed at the end of a run: the first ANALYZED_FIRST ones (see
+ * global_autocorrelation and save_spike_activity) and the first
+ * ANALYZED_INHIBITORY inhibitory ones (see save_spike_activity). The
+ * autocorrelation of single neurons is computed during the run instead,
+ * see autocorrelation.c. */
+#define ANALYZED_FIRST 100
+#define ANALYZED_INHIBITORY 100
+
+static inline bool keeps_train(const struct Network *ntw, int i)
+{
+        return i < ANALYZED_FIRST || (i >= ntw->NE && i < ntw->NE + ANALYZED_INHIBITORY);
+}
+
+/* Append a spike to the history */
+static inline void record_spike(struct SpikeHistory *h, int id, double time)
+{
+        struct SpikeEvent *e;
+
+        if (h->n == (size_t) h->n_chunks * HISTORY_CHUNK)
+                add_history_chunk(h);
+        e = &h->chunk[h->n / HISTORY_CHUNK][h->n % HISTORY_CHUNK];
+        e->time = time;
+        e->id = id;
+        h->n++;
+        h->indexed = false;
+}
+
+/* Time derivative of the membrane potential. Defined here so that it can be
+ * inlined in the update loop. */
+static inline real euler(const struct Network *ntw, real V,
+                real I_fast, real I_slow)
+{
+        return (-V  + (real) ntw->ext_current + I_fast + I_slow) / (real) ntw->tau_m;
+}
 #endif
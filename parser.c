@@ -127,7 +127,63 @@ int parse_config_file(const char *filename, struct State *S)
                                         *r = '\0';
                                 value = rstrip(value);
                                 value = unquote(value);
-                                if (strncmp(name, "N", 1) == 0) {
+                                if (strncmp(name, "spike_archive", 13) == 0) {
+                                        snprintf(S->sim.spike_archive_file, MAX_PATH_LENGTH, "%s", value);
+                                } else if (strncmp(name, "rate_window", 11) == 0) {
+                                        set_time_window_size(S, atof(value));
+                                } else if (strncmp(name, "stream_trains", 13) == 0) {
+                                        S->sim.stream_trains = atoi(value) != 0;
+                                } else if (strncmp(name, "spike_record", 12) == 0) {
+                                        snprintf(S->sim.spike_record_file, MAX_PATH_LENGTH, "%s", value);
+                                } else if (strncmp(name, "record_all", 10) == 0) {
+                                        S->sim.record_all = atoi(value) != 0;
+                                } else if (strncmp(name, "block_size", 10) == 0) {
+                                        S->sim.block_size = atoi(value);
+                                } else if (strncmp(name, "processes", 9) == 0) {
+                                        S->sim.n_processes = atoi(value);
+                                } else if (strncmp(name, "sweep_ext_current", 17) == 0) {
+                                        S->sim.sweep.n_values[SWEEP_EXT_CURRENT] = parse_sweep_values(value,
+                                                        S->sim.sweep.values[SWEEP_EXT_CURRENT], MAX_SWEEP_VALUES);
+                                } else if (strncmp(name, "sweep_g", 7) == 0) {
+                                        S->sim.sweep.n_values[SWEEP_G] = parse_sweep_values(value,
+                                                        S->sim.sweep.values[SWEEP_G], MAX_SWEEP_VALUES);
+                                } else if (strncmp(name, "sweep_J", 7) == 0) {
+                                        S->sim.sweep.n_values[SWEEP_J] = parse_sweep_values(value,
+                                                        S->sim.sweep.values[SWEEP_J], MAX_SWEEP_VALUES);
+                                } else if (strncmp(name, "sweep_delay", 11) == 0) {
+                                        S->sim.sweep.n_values[SWEEP_DELAY] = parse_sweep_values(value,
+                                                        S->sim.sweep.values[SWEEP_DELAY], MAX_SWEEP_VALUES);
+                                } else if (strncmp(name, "sweep_workers", 13) == 0) {
+                                        S->sim.sweep.n_workers = atoi(value);
+                                } else if (strncmp(name, "trials", 6) == 0) {
+                                        S->sim.n_trials = atoi(value);
+                                } else if (strncmp(name, "concurrent_trials", 17) == 0) {
+                                        S->sim.concurrent_trials = atoi(value);
+                                } else if (strncmp(name, "checkpoint_interval", 19) == 0) {
+                                        S->sim.checkpoint_interval = atof(value);
+                                } else if (strncmp(name, "checkpoint", 10) == 0) {
+                                        snprintf(S->sim.checkpoint_file, MAX_PATH_LENGTH, "%s", value);
+                                } else if (strncmp(name, "restart", 7) == 0) {
+                                        snprintf(S->sim.restart_file, MAX_PATH_LENGTH, "%s", value);
+                                } else if (strncmp(name, "encoding", 8) == 0) {
+                                        ntw->encoding = parse_encoding(value);
+                                } else if (strncmp(name, "seed", 4) == 0) {
+                                        ntw->seed = strtoul(value, NULL, 0);
+                                } else if (strncmp(name, "kernel", 6) == 0) {
+                                        S->sim.kernel = parse_kernel(value);
+                                } else if (strncmp(name, "threads", 7) == 0) {
+                                        S->sim.n_threads = atoi(value);
+                                } else if (strncmp(name, "integrator", 10) == 0) {
+                                        S->sim.integrator = parse_integrator(value);
+                                } else if (strncmp(name, "dt", 2) == 0) {
+                                        S->sim.DT = atof(value);
+                                } else if (strncmp(name, "sampling", 8) == 0) {
+                                        ntw->sampling = parse_sampling(value);
+                                } else if (strncmp(name, "connectivity_file", 17) == 0) {
+                                        snprintf(ntw->matrix_file, MAX_PATH_LENGTH, "%s", value);
+                                } else if (strncmp(name, "connectivity", 12) == 0) {
+                                        ntw->connectivity = parse_connectivity(value);
+                                } else if (strncmp(name, "N", 1) == 0) {
                                         ntw->N = atoi(value);
                                 } else if (strncmp(name, "f", 1) == 0) {
                                         tmp = atof(value);
@@ -187,7 +243,50 @@ the population rates, and the autocorrelations.\n\n\
     -r, --refractory-period=REAL        set the refractory period (in ms) \n\
     -D, --synaptic-delay=REAL           set the synaptic delay (in ms) \n\
     -t, --synaptic-time-constant=REAL   set the time constant of fast synapses\n\
-    -I, --external-current=REAL         set the homogeneous external current (in mV)\n\n\
+    -I, --external-current=REAL         set the homogeneous external current (in mV)\n\
+    -s, --sampling=NAME                 set how connections are drawn: selection\n\
+                                        (Knuth's selection sampling, O(N) per neuron)\n\
+                                        or floyd (Floyd's algorithm, O(C) per neuron)\n\
+    -p, --connectivity=NAME             stored (synaptic matrix in memory) or procedural\n\
+                                        (targets regenerated at each spike, O(N) memory)\n\
+    -S, --seed=INT                      set the seed of the random streams that build the\n\
+                                        network and its initial state\n\
+    -F, --connectivity-file=FILE        map the synaptic matrix from FILE if it holds this\n\
+                                        network; otherwise build it and save it to FILE\n\n\
+  Simulation parameters:\n\
+    -d, --time-step=REAL                set the integration time step (in ms)\n\
+    -i, --integrator=NAME               set the integration scheme: euler, or exact\n\
+                                        (exact propagator, allows larger time steps)\n\
+    -B, --trials=INT                    run INT trials on the same network, from different\n\
+                                        initial conditions, and save their averages\n\
+    -W, --rate-window=REAL              set the width of the windows of the population rates\n\
+                                        (in ms, rounded to time steps; default 0.5)\n\n");
+                printf("  Spike records:\n\
+    -o, --spike-record=FILE             record the spikes in binary in FILE during the run\n\
+                                        (see print_spikes)\n\
+    -a, --record-all                    record the spikes of all neurons, not only those of\n\
+                                        the sample in the spike file\n\
+    -m, --stream-trains                 keep at most 16384 spikes of the history in memory,\n\
+                                        and stream the rest to disk until the end of the run\n\
+    -A, --spike-archive=FILE            save the spike trains of the analyzed neurons in FILE\n\
+                                        at the end of the run, in binary, to be mapped\n\n\
+  Checkpoints:\n\
+    -K, --checkpoint=FILE               save the state of the simulation to FILE periodically\n\
+    -P, --checkpoint-interval=REAL      set the interval between checkpoints (in ms of\n\
+                                        simulated time)\n\
+    -R, --restart=FILE                  resume the simulation saved in FILE\n\n\
+  Performance:\n\
+    -k, --kernel=NAME                   membrane update kernel: auto, scalar, avx2 or avx512\n\
+    -n, --threads=INT                   set the number of threads (of each trial)\n\
+    -b, --block-size=INT                advance blocks of INT neurons through all the steps\n\
+                                        of a synaptic delay at once, to keep them in cache\n\
+    -j, --concurrent-trials=INT         run up to INT trials of a batch at once\n\
+    -w, --sweep-workers=INT             run up to INT points of a sweep at once (default:\n\
+                                        as many as the cores allow)\n\
+    -M, --processes=INT                 distribute the network over INT processes, each\n\
+                                        with its own neurons and their synapses\n\
+    -e, --encoding=NAME                 how the synaptic matrix is held: raw (4 bytes per\n\
+                                        synapse) or varint (delta-encoded, 1-2 bytes)\n\n\
   Miscellaneous:\n\
     -h, --help                          display this help and exit\n\n");
                 exit(status);
@@ -208,6 +307,28 @@ static struct option long_opts[] = {
         {"synaptic-delay", required_argument, NULL, 'D'},
         {"synaptic-time-constant", required_argument, NULL, 't'},
         {"ext-current", required_argument, NULL, 'I'},
+        {"sampling", required_argument, NULL, 's'},
+        {"connectivity", required_argument, NULL, 'p'},
+        {"seed", required_argument, NULL, 'S'},
+        {"connectivity-file", required_argument, NULL, 'F'},
+        {"time-step", required_argument, NULL, 'd'},
+        {"integrator", required_argument, NULL, 'i'},
+        {"kernel", required_argument, NULL, 'k'},
+        {"threads", required_argument, NULL, 'n'},
+        {"encoding", required_argument, NULL, 'e'},
+        {"checkpoint", required_argument, NULL, 'K'},
+        {"checkpoint-interval", required_argument, NULL, 'P'},
+        {"restart", required_argument, NULL, 'R'},
+        {"trials", required_argument, NULL, 'B'},
+        {"concurrent-trials", required_argument, NULL, 'j'},
+        {"sweep-workers", required_argument, NULL, 'w'},
+        {"processes", required_argument, NULL, 'M'},
+        {"block-size", required_argument, NULL, 'b'},
+        {"spike-record", required_argument, NULL, 'o'},
+        {"record-all", no_argument, NULL, 'a'},
+        {"stream-trains", no_argument, NULL, 'm'},
+        {"rate-window", required_argument, NULL, 'W'},
+        {"spike-archive", required_argument, NULL, 'A'},
         {0, 0, 0, 0}
 };
 
@@ -227,7 +348,7 @@ int process_options(void *s, int argc, char *argv[])
         opterr = 1;
         optind = 1; /* reset the counter (extern) */
 
-        while ((c = getopt_long(argc, argv, "hvc:N:C:f:J:g:T:r:D:t:I:",
+        while ((c = getopt_long(argc, argv, "hvc:N:C:f:J:g:T:r:D:t:I:s:p:S:F:d:i:k:n:e:K:P:R:B:j:w:M:b:o:amW:A:",
                                         long_opts, &option_index)) != -1) {
 
                 switch (c) {
@@ -266,6 +387,50 @@ int process_options(void *s, int argc, char *argv[])
                                         ntw->tau_fast = atof(optarg);
                                 } else if (strcmp(long_opts[option_index].name, "external-current") == 0) {
                                         ntw->ext_current = atof(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "sampling") == 0) {
+                                        ntw->sampling = parse_sampling(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "connectivity") == 0) {
+                                        ntw->connectivity = parse_connectivity(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "seed") == 0) {
+                                        ntw->seed = strtoul(optarg, NULL, 0);
+                                } else if (strcmp(long_opts[option_index].name, "connectivity-file") == 0) {
+                                        snprintf(ntw->matrix_file, MAX_PATH_LENGTH, "%s", optarg);
+                                } else if (strcmp(long_opts[option_index].name, "time-step") == 0) {
+                                        sim->DT = atof(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "integrator") == 0) {
+                                        sim->integrator = parse_integrator(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "kernel") == 0) {
+                                        sim->kernel = parse_kernel(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "threads") == 0) {
+                                        sim->n_threads = atoi(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "encoding") == 0) {
+                                        ntw->encoding = parse_encoding(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "checkpoint") == 0) {
+                                        snprintf(sim->checkpoint_file, MAX_PATH_LENGTH, "%s", optarg);
+                                } else if (strcmp(long_opts[option_index].name, "checkpoint-interval") == 0) {
+                                        sim->checkpoint_interval = atof(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "restart") == 0) {
+                                        snprintf(sim->restart_file, MAX_PATH_LENGTH, "%s", optarg);
+                                } else if (strcmp(long_opts[option_index].name, "trials") == 0) {
+                                        sim->n_trials = atoi(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "concurrent-trials") == 0) {
+                                        sim->concurrent_trials = atoi(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "sweep-workers") == 0) {
+                                        sim->sweep.n_workers = atoi(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "processes") == 0) {
+                                        sim->n_processes = atoi(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "block-size") == 0) {
+                                        sim->block_size = atoi(optarg);
+                                } else if (strcmp(long_opts[option_index].name, "spike-record") == 0) {
+                                        snprintf(sim->spike_record_file, MAX_PATH_LENGTH, "%s", optarg);
+                                } else if (strcmp(long_opts[option_index].name, "record-all") == 0) {
+                                        sim->record_all = true;
+                                } else if (strcmp(long_opts[option_index].name, "stream-trains") == 0) {
+                                        sim->stream_trains = true;
+                                } else if (strcmp(long_opts[option_index].name, "rate-window") == 0) {
+                                        set_time_window_size(S, atof(optarg));
+                                } else if (strcmp(long_opts[option_index].name, "spike-archive") == 0) {
+                                        snprintf(sim->spike_archive_file, MAX_PATH_LENGTH, "%s", optarg);
                                 }
                                 break;
                         case 'h':
@@ -314,6 +479,72 @@ int process_options(void *s, int argc, char *argv[])
                         case 'I':
                                 ntw->ext_current = atof(optarg);
                                 break;
+                        case 's':
+                                ntw->sampling = parse_sampling(optarg);
+                                break;
+                        case 'p':
+                                ntw->connectivity = parse_connectivity(optarg);
+                                break;
+                        case 'S':
+                                ntw->seed = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'F':
+                                snprintf(ntw->matrix_file, MAX_PATH_LENGTH, "%s", optarg);
+                                break;
+                        case 'd':
+                                sim->DT = atof(optarg);
+                                break;
+                        case 'i':
+                                sim->integrator = parse_integrator(optarg);
+                                break;
+                        case 'k':
+                                sim->kernel = parse_kernel(optarg);
+                                break;
+                        case 'n':
+                                sim->n_threads = atoi(optarg);
+                                break;
+                        case 'e':
+                                ntw->encoding = parse_encoding(optarg);
+                                break;
+                        case 'K':
+                                snprintf(sim->checkpoint_file, MAX_PATH_LENGTH, "%s", optarg);
+                                break;
+                        case 'P':
+                                sim->checkpoint_interval = atof(optarg);
+                                break;
+                        case 'R':
+                                snprintf(sim->restart_file, MAX_PATH_LENGTH, "%s", optarg);
+                                break;
+                        case 'B':
+                                sim->n_trials = atoi(optarg);
+                                break;
+                        case 'j':
+                                sim->concurrent_trials = atoi(optarg);
+                                break;
+                        case 'w':
+                                sim->sweep.n_workers = atoi(optarg);
+                                break;
+                        case 'M':
+                                sim->n_processes = atoi(optarg);
+                                break;
+                        case 'b':
+                                sim->block_size = atoi(optarg);
+                                break;
+                        case 'o':
+                                snprintf(sim->spike_record_file, MAX_PATH_LENGTH, "%s", optarg);
+                                break;
+                        case 'a':
+                                sim->record_all = true;
+                                break;
+                        case 'm':
+                                sim->stream_trains = true;
+                                break;
+                        case 'W':
+                                set_time_window_size(S, atof(optarg));
+                                break;
+                        case 'A':
+                                snprintf(sim->spike_archive_file, MAX_PATH_LENGTH, "%s", optarg);
+                                break;
                         default:
                                 printf("Invalid option -- '%s'\n", optarg);
                                 printf("Try <exec> --help for more information\n");
@@ -7,6 +7,8 @@
 #include "eprintf.h"
 #include "network.h"
 #include "simulation.h"
+#include "kernels.h"
+#include "sweep.h"
 
 #define MAX_CHAR_SYMBOLS 25
 #define MAX_LINE 200
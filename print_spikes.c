@@ -0,0 +1,52 @@
+/* Print a spike record file of simulate_one_trial (see spikelog.c) as text,
+ * one spike per line with its time and neuron, in the format of the spike
+ * files. A neuron range can be given to print only those neurons.
+ *
+ * Usage: print_spikes FILE [FIRST LAST] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eprintf.h"
+#include "spikelog.h"
+
+#define RECORDS 4096
+
+int main(int argc, char *argv[])
+{
+        struct SpikeLogHeader h;
+        struct SpikeRecord r[RECORDS];
+        int first = 0, last = -1;
+        size_t n;
+        FILE *f;
+
+        setprogname("print_spikes");
+        if (argc != 2 && argc != 4) {
+                fprintf(stderr, "Usage: %s FILE [FIRST LAST]\n", argv[0]);
+                return 2;
+        }
+        if ((f = fopen(argv[1], "rb")) == NULL)
+                eprintf("cannot open '%s':", argv[1]);
+        if (fread(&h, sizeof(h), 1, f) != 1
+                        || memcmp(h.magic, SPIKE_LOG_MAGIC, sizeof(SPIKE_LOG_MAGIC)) != 0)
+                eprintf("'%s' is not a spike record file\n", argv[1]);
+        if (h.version != SPIKE_LOG_VERSION)
+                eprintf("'%s' has version %u, expected %u\n", argv[1], h.version,
+                                SPIKE_LOG_VERSION);
+        if (argc == 4) {
+                first = atoi(argv[2]);
+                last = atoi(argv[3]);
+        } else {
+                last = h.N - 1;
+        }
+        printf("# N = %d, NE = %d, dt = %g, %s neurons\n", h.N, h.NE, h.DT,
+                        h.all ? "all" : "sampled");
+        while ((n = fread(r, sizeof(r[0]), RECORDS, f)) > 0) {
+                for (size_t k = 0; k < n; k++)
+                        if (r[k].id >= first && r[k].id <= last)
+                                printf("% 7.3f % 4d\n", r[k].step * h.DT + r[k].offset, r[k].id);
+        }
+        if (ferror(f))
+                eprintf("cannot read '%s':", argv[1]);
+        fclose(f);
+        return 0;
+}
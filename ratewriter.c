@@ -0,0 +1,168 @@
+/* Population rates written by a separate thread.
+ *
+ * The rates of every sampling window are appended to a ring of samples
+ * instead of being formatted on the simulation thread. Every RATE_BATCH
+ * samples the ring is handed to a writer thread, which formats them in the
+ * format of the population rate file, writes them in one go and shows the
+ * progress of the run. The simulation only waits if the writer falls a
+ * whole ring behind, so that windows as short as a time step (see -W) cost
+ * it next to nothing. */
+#include "ratewriter.h"
+
+#define RATE_RING 8192          /* samples in the ring */
+#define RATE_BATCH 256          /* samples handed to the writer at a time */
+#define RATE_TEXT (1 << 16)     /* bytes of text written at a time */
+
+struct RateSample {
+        double time;
+        double rate_e;
+        double rate_i;
+};
+
+struct RateWriter {
+        FILE *f;
+        bool show_progress;
+        struct RateSample *ring;
+        size_t head;            /* samples recorded */
+        size_t ready;           /* samples handed to the writer */
+        size_t tail;            /* samples written */
+        char *text;
+        bool done;
+        pthread_t writer;
+        bool threaded;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool failed;
+};
+
+static void write_samples(struct RateWriter *w, size_t from, size_t to)
+{
+        /* Format and write samples from, ..., to - 1 of the ring */
+        const struct RateSample *s;
+        size_t n = 0;
+
+        for (size_t k = from; k < to; k++) {
+                s = &w->ring[k % RATE_RING];
+                n += snprintf(w->text + n, RATE_TEXT - n, "% 9.3f  % 9.3f % 9.3f\n",
+                                s->time, s->rate_e, s->rate_i);
+                if (n > RATE_TEXT - 128 || k == to - 1) {
+                        if (fwrite(w->text, 1, n, w->f) != n)
+                                w->failed = true;
+                        n = 0;
+                }
+        }
+        if (w->show_progress && to > from) {
+                report("% 9.3f   \r ", w->ring[(to - 1) % RATE_RING].time);
+                fflush(stdout);
+        }
+}
+
+static void *rate_writer(void *arg)
+{
+        /* Write the samples handed over, until told to stop */
+        struct RateWriter *w = arg;
+        size_t from, to;
+
+        pthread_mutex_lock(&w->lock);
+        for (;;) {
+                while (w->tail == w->ready && !w->done)
+                        pthread_cond_wait(&w->cond, &w->lock);
+                if (w->tail == w->ready)
+                        break;
+                from = w->tail;
+                to = w->ready;
+                pthread_mutex_unlock(&w->lock);
+                write_samples(w, from, to);
+                pthread_mutex_lock(&w->lock);
+                w->tail = to;
+                pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+        return NULL;
+}
+
+static void hand_over(struct RateWriter *w, size_t room)
+{
+        /* Give the recorded samples to the writer, and wait until at most
+         * RATE_RING - room of them are left to write */
+        if (!w->threaded) {
+                write_samples(w, w->tail, w->head);
+                w->tail = w->ready = w->head;
+                return;
+        }
+        pthread_mutex_lock(&w->lock);
+        w->ready = w->head;
+        pthread_cond_broadcast(&w->cond);
+        while (w->head - w->tail > RATE_RING - room)
+                pthread_cond_wait(&w->cond, &w->lock);
+        pthread_mutex_unlock(&w->lock);
+}
+
+void open_rate_writer(struct State *S)
+{
+        /* Write the population rates of the run from a separate thread */
+        struct Simulation *sim = &S->sim;
+        struct RateWriter *w;
+
+        w = emalloc(sizeof(*w));
+        w->f = sim->pop_rates_file;
+        w->show_progress = sim->show_progress;
+        w->ring = emalloc(RATE_RING * sizeof(struct RateSample));
+        w->text = emalloc(RATE_TEXT);
+        w->head = w->ready = w->tail = 0;
+        w->done = false;
+        w->failed = false;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        /* Without a thread, samples are written as they are handed over */
+        w->threaded = pthread_create(&w->writer, NULL, rate_writer, w) == 0;
+        sim->rate_writer = w;
+}
+
+void write_rates(struct State *S, double time, double rate_e, double rate_i)
+{
+        /* Record the rates (in Hz) of the window that ends at time */
+        struct RateWriter *w = S->sim.rate_writer;
+        struct RateSample *s = &w->ring[w->head % RATE_RING];
+
+        s->time = time;
+        s->rate_e = rate_e;
+        s->rate_i = rate_i;
+        if (++w->head % RATE_BATCH == 0)
+                hand_over(w, RATE_BATCH);
+}
+
+void flush_rate_writer(struct State *S)
+{
+        /* Wait until every sample recorded is in the file */
+        struct RateWriter *w = S->sim.rate_writer;
+
+        if (w != NULL)
+                hand_over(w, RATE_RING);
+        fflush(S->sim.pop_rates_file);
+}
+
+void close_rate_writer(struct State *S)
+{
+        /* Write what is left and stop the writer */
+        struct RateWriter *w = S->sim.rate_writer;
+
+        if (w == NULL)
+                return;
+        hand_over(w, RATE_RING);
+        if (w->threaded) {
+                pthread_mutex_lock(&w->lock);
+                w->done = true;
+                pthread_cond_broadcast(&w->cond);
+                pthread_mutex_unlock(&w->lock);
+                pthread_join(w->writer, NULL);
+        }
+        if (fflush(w->f) != 0 || w->failed)
+                weprintf("cannot write the population rates:");
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        free(w->ring);
+        free(w->text);
+        free(w);
+        S->sim.rate_writer = NULL;
+}
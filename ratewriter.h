@@ -0,0 +1,11 @@
+#ifndef _RATEWRITER_H
+#define _RATEWRITER_H 1
+
+#include "simulation.h"
+
+/* ratewriter.c */
+void open_rate_writer(struct State *S);
+void write_rates(struct State *S, double time, double rate_e, double rate_i);
+void flush_rate_writer(struct State *S);
+void close_rate_writer(struct State *S);
+#endif
@@ -0,0 +1,70 @@
+/* Counter-based random number streams */
+#include <math.h>
+#include "rng.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+        uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+        uint32_t k0 = key[0], k1 = key[1];
+        uint64_t p0, p1;
+
+        for (int round = 0; round < 10; round++) {
+                p0 = (uint64_t) PHILOX_M0 * c0;
+                p1 = (uint64_t) PHILOX_M1 * c2;
+                c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+                c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+                c1 = (uint32_t) p1;
+                c3 = (uint32_t) p0;
+                k0 += PHILOX_W0;
+                k1 += PHILOX_W1;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+}
+
+void stream_init(struct Stream *s, unsigned long seed, unsigned id,
+                unsigned purpose, unsigned substream)
+{
+        /* The seed is the key; id, purpose and substream fix the upper
+         * words of the counter, and the lowest word runs along the stream */
+        s->key[0] = (uint32_t) seed;
+        s->key[1] = (uint32_t) ((uint64_t) seed >> 32);
+        s->ctr[0] = 0;
+        s->ctr[1] = id;
+        s->ctr[2] = purpose;
+        s->ctr[3] = substream;
+        s->used = 4;
+}
+
+double stream_uniform(struct Stream *s)
+{
+        /* Uniform variate in [0, 1) with 53 random bits, built from two
+         * 32-bit words */
+        uint64_t x;
+
+        if (s->used == 4) {
+                philox4x32_10(s->ctr, s->key, s->out);
+                s->ctr[0]++;
+                s->used = 0;
+        }
+        x = ((uint64_t) s->out[s->used] << 21) ^ (s->out[s->used + 1] >> 11);
+        s->used += 2;
+        return x * (1.0 / 9007199254740992.0);
+}
+
+double stream_gaussian(struct Stream *s)
+{
+        /* Standard normal variate (Box-Muller). The second variate of the
+         * pair is discarded, so that the stream carries no hidden state. */
+        double U1 = 1.0 - stream_uniform(s);   /* in (0, 1] */
+        double U2 = stream_uniform(s);
+
+        return sqrt(-2.0 * log(U1)) * cos(2.0 * M_PI * U2);
+}
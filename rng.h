@@ -0,0 +1,30 @@
+#ifndef _RNG_H
+#define _RNG_H 1
+
+#include <stdint.h>
+
+/* What a random stream is used for. Streams with different purposes are
+ * statistically independent even if they share seed and id. */
+enum StreamPurpose {
+        STREAM_PROJECTIONS = 1,   /* procedural connectivity */
+        STREAM_INNERVATIONS,      /* stored connectivity */
+        STREAM_INITIAL_STATE,     /* initial conditions of the neurons */
+};
+
+struct Stream {
+        /* Counter-based random stream (Philox4x32-10, Salmon et al., SC'11).
+         * Every draw is a pure function of the seed, the id, the purpose,
+         * the substream and the position in the stream, so streams can be
+         * created anywhere, in any order, by any thread. */
+        uint32_t key[2];
+        uint32_t ctr[4];
+        uint32_t out[4];
+        int used;   /* words of out already consumed */
+};
+
+/* rng.c */
+void stream_init(struct Stream *s, unsigned long seed, unsigned id,
+                unsigned purpose, unsigned substream);
+double stream_uniform(struct Stream *s);
+double stream_gaussian(struct Stream *s);
+#endif
@@ -4,40 +4,70 @@
 #include "parser.h"
 #include "network.h"
 #include "simulation.h"
+#include "checkpoint.h"
+#include "batch.h"
+#include "sweep.h"
+#include "distributed.h"
+#include "spikelog.h"
+#include "trainstream.h"
+#include "ratewriter.h"
+#include "spikearchive.h"
 #include "eprintf.h"
 
 int main(int argc, char *argv[])
 {
     int status = 0;
     struct State S;
+    double rate_e, rate_i;
     setup_state(&S);
-    setup_rng();
     set_total_time(&S, 20000); /* duration simulation (ms) */
     set_dt(&S, 0.05); /* timestep (ms) */
     /* width of the window over which we sample population rates */
     set_time_window_size(&S, 0.5);
     status = read_network_parameters(argc, argv, &S);
+    if (S.sim.n_processes > 1) {
+        /* The network distributed over several processes, all of which run
+         * from here on; the first one writes the outputs */
+        struct Comm comm;
+        comm_init(&comm, S.sim.n_processes);
+        S.sim.rank = comm.rank;
+        if (comm.rank != 0)
+            S.sim.verbose = false;
+        status = initialize_network(&S);
+        build_connectivity(&S);
+        run_distributed(&S, &comm);
+        free_state(&S);
+        return comm_finalize(&comm, status);
+    }
     status = initialize_network(&S);
-    fill_synaptic_matrix(&S.ntw);
-    open_file_handlers(&S);
-
-    int n_skipped_samples = (int) (S.sim.time_window_size / S.sim.DT);
-    int iters_since_last_flush = 1;
-
-    /* Here we go */
-    while (S.sim.time < S.sim.total_time) {
-        simulate_one_step(&S);
-        if (iters_since_last_flush == n_skipped_samples) {
-            flush_population_rate(&S);
-            iters_since_last_flush = 0;
-        }
-        iters_since_last_flush++;
+    build_connectivity(&S);
+    if (sweep_points(&S.sim.sweep) > 0) {
+        /* A grid of parameters on the same network */
+        run_sweep(&S);
+    } else if (S.sim.n_trials > 1) {
+        /* Many trials on the same network */
+        open_file_handlers(&S);
+        run_batch(&S, &rate_e, &rate_i);
+    } else {
+        open_file_handlers(&S);
+        if (S.sim.restart_file[0] != '\0' && restore_checkpoint(&S, S.sim.restart_file) != 0)
+            eprintf("cannot restart from '%s'\n", S.sim.restart_file);
+        open_spike_log(&S);
+        open_train_stream(&S);
+        open_rate_writer(&S);
+        /* Here we go */
+        run_trial(&S);
+        close_rate_writer(&S);
+        close_spike_log(&S);
+        sort_streamed_history(&S);
+        finish_checkpoints(&S);
+        archive_spike_trains(&S);
+        save_spike_activity(&S);
+        save_final_state(&S);
+        report("\n");
+        compute_average_autocorrelations(&S);
+        compute_global_autocorrelations(&S);
     }
-    save_spike_activity(&S);
-    save_pdfs_synaptic_vars(&S.ntw);
-    report("\n");
-    compute_average_autocorrelations(&S);
-    compute_global_autocorrelations(&S);
     free_state(&S);
     return status;
 }
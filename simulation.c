@@ -1,4 +1,21 @@
 #include "simulation.h"
+#include "kernels.h"
+#include "checkpoint.h"
+#include "sweep.h"
+#include "spikelog.h"
+#include "trainstream.h"
+#include "ratewriter.h"
+#include "spikearchive.h"
+#include "autocorrelation.h"
+#include <float.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+static inline int omp_get_thread_num(void) { return 0; }
+static inline int omp_get_num_threads(void) { return 1; }
+static inline void omp_set_num_threads(int n) { (void) n; }
+#endif
 
 void setup_simulation(struct Simulation *sim)
 {
@@ -9,39 +26,122 @@ void setup_simulation(struct Simulation *sim)
         sim->DT = 0.05;
         sim->time_window_size = 1.0;
         sim->verbose = false;
+        sim->show_progress = true;
+        sim->kernel = KERNEL_AUTO;
+        sim->integrator = INTEGRATOR_EULER;
+        sim->integrate = NULL;
+        sim->n_threads = 1;
+        sim->n_ranges = 0;
+        sim->range = NULL;
+        sim->block_size = 0;
+        sim->window_capacity = 0;
+        sim->fired = NULL;
+        sim->checkpoint_file[0] = '\0';
+        sim->restart_file[0] = '\0';
+        sim->checkpoint_interval = 0;
+        sim->next_checkpoint = 0;
+        sim->checkpoint_pending = false;
+        sim->n_trials = 1;
+        sim->concurrent_trials = 1;
+        sim->record_rates = false;
+        for (int k = 0; k < 3; k++)
+                sim->rate_trace[k].data = NULL;
+        sim->spikes_file = NULL;
+        sim->pop_rates_file = NULL;
+        sim->rate_writer = NULL;
+        for (int k = 0; k < N_SWEEP_PARAMETERS; k++)
+                sim->sweep.n_values[k] = 0;
+        sim->sweep.n_workers = 0;
+        sim->n_processes = 1;
+        sim->rank = 0;
+        sim->spike_record_file[0] = '\0';
+        sim->record_all = false;
+        sim->spike_log = NULL;
+        sim->spike_log_offset = -1;
+        sim->stream_trains = false;
+        sim->train_stream = NULL;
+        sim->sorted_trains = NULL;
+        sim->spike_archive_file[0] = '\0';
+        sim->archive = NULL;
+        sim->autocorrelation = NULL;
         strcpy(sim->config_file, "brunel2000.conf");
 }
 
+static void format_value(char *s, size_t size, double v)
+{
+        /* Write v with the fewest digits, from the 6 of %g to the DBL_DIG
+         * that every value typed in a sweep keeps, that read back as v, so
+         * that distinct values get distinct names; the decimal point is
+         * written as 'p' */
+        for (int digits = 6; digits <= DBL_DIG; digits++) {
+                snprintf(s, size, "%.*g", digits, v);
+                if (strtod(s, NULL) == v)
+                        break;
+        }
+        string_replace(s, '.', 'p');
+}
+
 void create_suffix(struct State *S, char *sfx)
 {
-        char times_str[28];
-        char tau_fast_str[5];
-        char delay_str[5];
-        char *t1, *d1;
-        sprintf(tau_fast_str, "%04.1f", S->ntw.tau_fast);
-        sprintf(delay_str, "%4.2f", S->ntw.delay);
-        t1 = string_replace(tau_fast_str, '.', 'p');
-        d1 = string_replace(delay_str, '.', 'p');
+        char tau_fast_str[32];
+        char delay_str[32];
+        int n, n_tau;
+        n_tau = snprintf(tau_fast_str, sizeof(tau_fast_str), "%04.1f", S->ntw.tau_fast);
+        string_replace(tau_fast_str, '.', 'p');
+        /* Delays keep two decimals unless that rounds them (sweeps) */
+        snprintf(delay_str, sizeof(delay_str), "%4.2f", S->ntw.delay);
+        if (fabs(strtod(delay_str, NULL) - S->ntw.delay) <= 1e-9 * fabs(S->ntw.delay))
+                string_replace(delay_str, '.', 'p');
+        else
+                format_value(delay_str, sizeof(delay_str), S->ntw.delay);
         if (S->ntw.slow_flag)
-                sprintf(times_str, "_delay_%s_T1_%s_T2_%d", d1, t1, (int) S->ntw.tau_slow);
+                n = snprintf(S->sim.suffix, MAX_SUFFIX_LENGTH, "%s_delay_%s_T1_%s_T2_%d.dat",
+                                sfx, delay_str, tau_fast_str, (int) S->ntw.tau_slow);
         else
-                sprintf(times_str, "_delay_%s_T1_%s", d1, t1);
-        sprintf(S->sim.suffix, "%s", sfx);
-        strcat(S->sim.suffix, times_str);
-        strcat(S->sim.suffix, ".dat");
+                n = snprintf(S->sim.suffix, MAX_SUFFIX_LENGTH, "%s_delay_%s_T1_%s.dat",
+                                sfx, delay_str, tau_fast_str);
+        if (n >= MAX_SUFFIX_LENGTH || n_tau >= (int) sizeof(tau_fast_str))
+                eprintf("the file names of this run would be longer than %d characters\n",
+                                MAX_SUFFIX_LENGTH - 1);
+}
+
+static void append_value(char *s, size_t size, const char *name, double v)
+{
+        /* Append _name_v to s */
+        char v_str[32];
+        size_t n = strlen(s);
+        format_value(v_str, sizeof(v_str), v);
+        snprintf(s + n, size - n, "_%s_%s", name, v_str);
 }
 
 void open_file_handlers(struct State *S)
 {
-        char filename[100];
-        char sfx[20];
+        char filename[MAX_FILENAME_LENGTH];
+        char sfx[MAX_SUFFIX_LENGTH];
         struct Simulation *sim = &S->sim;
-        sprintf(sfx, "N_%05d_mu_%02d", S->ntw.N, (int) (S->ntw.ext_current));
+        struct Network *ntw = &S->ntw;
+        /* The points of a sweep also need the swept parameters that the
+         * usual suffix does not tell apart */
+        if (sim->sweep.n_values[SWEEP_EXT_CURRENT] > 0 && ntw->ext_current != rint(ntw->ext_current)) {
+                snprintf(sfx, sizeof(sfx), "N_%05d", ntw->N);
+                append_value(sfx, sizeof(sfx), "mu", ntw->ext_current);
+        } else {
+                snprintf(sfx, sizeof(sfx), "N_%05d_mu_%02d", ntw->N, (int) (ntw->ext_current));
+        }
+        if (sim->sweep.n_values[SWEEP_G] > 0)
+                append_value(sfx, sizeof(sfx), "g", ntw->g);
+        if (sim->sweep.n_values[SWEEP_J] > 0)
+                append_value(sfx, sizeof(sfx), "J", ntw->J);
         create_suffix(S, sfx);
-        sprintf(filename, "spikes_%s", S->sim.suffix);
+        snprintf(filename, sizeof(filename), "spikes_%s", S->sim.suffix);
         sim->spikes_file = fopen(filename, "w");
-        sprintf(filename, "population_rate_%s", S->sim.suffix);
-        sim->pop_rates_file = fopen(filename, "w");
+        snprintf(filename, sizeof(filename), "population_rate_%s", S->sim.suffix);
+        /* A restarted run continues the file written before the checkpoint */
+        sim->pop_rates_file = NULL;
+        if (sim->restart_file[0] != '\0')
+                sim->pop_rates_file = fopen(filename, "r+");
+        if (sim->pop_rates_file == NULL)
+                sim->pop_rates_file = fopen(filename, "w");
 }
 
 void write_header(FILE* dev, struct State *S)
@@ -63,6 +163,28 @@ void setup_state(struct State *S)
         setup_simulation(&S->sim);
 }
 
+void clone_state(struct State *dst, const struct State *src)
+{
+        /* A state that runs trials on the network of src, see clone_network.
+         * It has no output files of its own. */
+        struct Simulation *sim = &dst->sim;
+
+        *sim = src->sim;
+        sim->spikes_file = NULL;
+        sim->pop_rates_file = NULL;
+        sim->rate_writer = NULL;
+        sim->checkpoint_pending = false;
+        sim->spike_log = NULL;
+        sim->train_stream = NULL;
+        sim->sorted_trains = NULL;
+        sim->archive = NULL;
+        for (int k = 0; k < 3; k++)
+                init_dynamic_array(&sim->rate_trace[k]);
+        clone_network(&dst->ntw, &src->ntw);
+        partition_network(dst);
+        start_autocorrelation(dst);
+}
+
 void free_state(struct State *S)
 {
         free_network(&S->ntw);
@@ -93,8 +215,10 @@ int initialize_network(struct State *S)
 {
         struct Network *ntw = &S->ntw;
         double dt = S->sim.DT;
+        S->sim.next_checkpoint = S->sim.checkpoint_interval;
         S->sim.exp_decay_fast = exp(-dt/ntw->tau_fast);
         S->sim.exp_decay_slow = exp(-dt/ntw->tau_slow);
+        set_propagator(S);
 
         double rei = (double) ntw->NE / (double) ntw->NI;
         double f = rei / (1 + rei); 
@@ -104,19 +228,312 @@ int initialize_network(struct State *S)
         /* Number of positions between past and present */
         int lag = (int) ceil(ntw->delay / dt);
 
+        /* The loops that build the network run on as many threads as the
+         * simulation itself */
+        if (S->sim.n_threads < 1)
+                S->sim.n_threads = 1;
+        omp_set_num_threads(S->sim.n_threads);
+        if (S->sim.n_trials < 1)
+                S->sim.n_trials = 1;
+        if (S->sim.concurrent_trials < 1)
+                S->sim.concurrent_trials = 1;
+        if (S->sim.n_processes < 1)
+                S->sim.n_processes = 1;
+        if (S->sim.n_processes > 1) {
+                if (S->sim.n_trials > 1 || sweep_points(&S->sim.sweep) > 0
+                                || ntw->matrix_file[0] != '\0') {
+                        if (S->sim.rank == 0)
+                                report("Batches, sweeps and connectivity files are not available "
+                                                "with several processes; ignoring them.\n");
+                        S->sim.n_trials = 1;
+                        for (int k = 0; k < N_SWEEP_PARAMETERS; k++)
+                                S->sim.sweep.n_values[k] = 0;
+                        ntw->matrix_file[0] = '\0';
+                }
+        }
+        if ((S->sim.n_trials > 1 || sweep_points(&S->sim.sweep) > 0 || S->sim.n_processes > 1)
+                        && (S->sim.checkpoint_file[0] != '\0'
+                                || S->sim.restart_file[0] != '\0')) {
+                if (S->sim.rank == 0)
+                        report("Checkpoints are not available with several trials, a sweep "
+                                        "or several processes; ignoring them.\n");
+                S->sim.checkpoint_file[0] = '\0';
+                S->sim.restart_file[0] = '\0';
+        }
+        if ((S->sim.n_trials > 1 || sweep_points(&S->sim.sweep) > 0 || S->sim.n_processes > 1)
+                        && S->sim.spike_record_file[0] != '\0') {
+                if (S->sim.rank == 0)
+                        report("Spike records are not available with several trials, a sweep "
+                                        "or several processes; ignoring them.\n");
+                S->sim.spike_record_file[0] = '\0';
+        }
+        if ((S->sim.n_trials > 1 || sweep_points(&S->sim.sweep) > 0 || S->sim.n_processes > 1
+                                || S->sim.checkpoint_file[0] != '\0') && S->sim.stream_trains) {
+                if (S->sim.rank == 0)
+                        report("Spike trains cannot be streamed with several trials, a sweep, "
+                                        "several processes or checkpoints; keeping them in memory.\n");
+                S->sim.stream_trains = false;
+        }
+        if ((S->sim.n_trials > 1 || sweep_points(&S->sim.sweep) > 0)
+                        && S->sim.spike_archive_file[0] != '\0') {
+                report("Spike archives are not available with several trials or a sweep; "
+                                "ignoring it.\n");
+                S->sim.spike_archive_file[0] = '\0';
+        }
+        set_local_range(S);
+
         /* allocate memory for all neurons in the population */
-        ntw->cell = emalloc(ntw->N * sizeof(struct Neuron));
+        allocate_neuron_state(ntw);
         ntw->top_ref_state = (int) ntw->tau_rp / dt;
         initialize_table_of_spikes(ntw, lag);
         initialize_individual_vars_for_neurons(ntw);
-        allocate_synaptic_structures(ntw);
+        start_autocorrelation(S);
+
+        partition_network(S);
+        S->sim.integrate = select_kernel(&S->sim.kernel, S->sim.integrator);
+        if (S->sim.verbose)
+                report("Using the %s kernel for the membrane update (%s integration), with %d thread(s).\n",
+                                kernel_name(S->sim.kernel), integrator_name(S->sim.integrator),
+                                S->sim.n_threads);
+        if (S->sim.verbose && S->sim.block_size > 0)
+                report("Blocked in time: %d ranges of about %d neurons, %d steps at a time.\n",
+                                S->sim.n_ranges, S->sim.block_size, lag > 0 ? lag : 1);
         return 0;
 }
 
+void set_propagator(struct State *S)
+{
+        /* Coefficients of the exact solution over one time step of
+         * tau_m dV/dt = -V + ext_current + I_fast + I_slow, with the
+         * currents decaying exponentially */
+        struct Simulation *sim = &S->sim;
+        struct Network *ntw = &S->ntw;
+        double dt = sim->DT;
+
+        sim->prop_mm = exp(-dt / ntw->tau_m);
+        sim->prop_ext = (1.0 - sim->prop_mm) * ntw->ext_current;
+        sim->prop_fast = membrane_response(dt, ntw->tau_fast, ntw->tau_m);
+        if (ntw->slow_flag)
+                sim->prop_slow = membrane_response(dt, ntw->tau_slow, ntw->tau_m);
+        else
+                sim->prop_slow = 0;
+}
+
+void set_local_range(struct State *S)
+{
+        /* Give each process a contiguous range of neurons, with the same
+         * alignment as the ranges of the threads (see partition_network) */
+        struct Network *ntw = &S->ntw;
+        int n = S->sim.n_processes;
+        int r = S->sim.rank;
+        int align = ntw->connectivity == CONNECTIVITY_PROCEDURAL ? PROCEDURAL_BLOCK : 8;
+
+        ntw->first_local = (int) ((long) ntw->N * r / n) / align * align;
+        if (r == n - 1)
+                ntw->last_local = ntw->N;
+        else
+                ntw->last_local = (int) ((long) ntw->N * (r + 1) / n) / align * align;
+}
+
+void partition_network(struct State *S)
+{
+        /* Split the local neurons into contiguous ranges, one per thread, or
+         * blocks of about block_size neurons if the run is blocked in time.
+         * The boundaries are multiples of 8 neurons, so that no two threads
+         * write to the same cache line of the state arrays. With procedural
+         * connectivity they are also multiples of the blocks in which
+         * targets are generated, so each block is generated by one thread. */
+        struct Simulation *sim = &S->sim;
+        int first = S->ntw.first_local;
+        int n_local = S->ntw.last_local - first;
+        int align = 8;
+        int size;
+
+        if (S->ntw.connectivity == CONNECTIVITY_PROCEDURAL)
+                align = PROCEDURAL_BLOCK;
+
+        if (sim->n_threads < 1)
+                sim->n_threads = 1;
+        sim->n_ranges = sim->n_threads;
+        if (sim->block_size > 0) {
+                size = (sim->block_size + align - 1) / align * align;
+                if ((n_local + size - 1) / size > sim->n_ranges)
+                        sim->n_ranges = (n_local + size - 1) / size;
+        }
+        sim->range = emalloc((sim->n_ranges + 1) * sizeof(int));
+        for (int r = 0; r < sim->n_ranges; r++)
+                sim->range[r] = first + (int) ((long) n_local * r / sim->n_ranges) / align * align;
+        sim->range[sim->n_ranges] = first + n_local;
+        sim->window_capacity = 0;
+        sim->fired = NULL;
+        reserve_spike_lists(sim, 1);
+}
+
+void reserve_spike_lists(struct Simulation *sim, int n_steps)
+{
+        /* Make room in fired for the spikes of n_steps steps. A neuron fires
+         * at most once per time step, so the spike list of each range never
+         * holds more entries than its neurons. */
+        struct SpikeList *fired;
+        int size;
+
+        if (n_steps <= sim->window_capacity)
+                return;
+        fired = erealloc(sim->fired, (size_t) n_steps * sim->n_ranges * sizeof(struct SpikeList));
+        for (int k = sim->window_capacity; k < n_steps; k++) {
+                for (int r = 0; r < sim->n_ranges; r++) {
+                        size = sim->range[r + 1] - sim->range[r];
+                        fired[k * sim->n_ranges + r].n = 0;
+                        fired[k * sim->n_ranges + r].id = emalloc((size + 1) * sizeof(int));
+                        fired[k * sim->n_ranges + r].time = emalloc((size + 1) * sizeof(double));
+                }
+        }
+        sim->fired = fired;
+        sim->window_capacity = n_steps;
+}
+
+void build_connectivity(struct State *S)
+{
+        /* Generate the synaptic matrix, or map it from the connectivity file
+         * if one was given and holds this network. Then split its rows by
+         * the target ranges of the threads, so that each thread delivers
+         * spikes to its own neurons only */
+        struct Network *ntw = &S->ntw;
+        bool cached = ntw->connectivity == CONNECTIVITY_STORED
+                && ntw->matrix_file[0] != '\0';
+
+        if (cached && load_synaptic_matrix(ntw, ntw->matrix_file) == 0) {
+                if (S->sim.verbose)
+                        report("Synaptic matrix mapped from '%s'.\n", ntw->matrix_file);
+        } else {
+                allocate_synaptic_structures(ntw);
+                fill_synaptic_matrix(ntw);
+                if (cached && save_synaptic_matrix(ntw, ntw->matrix_file) == 0
+                                && S->sim.verbose)
+                        report("Synaptic matrix saved to '%s'.\n", ntw->matrix_file);
+        }
+        split_synaptic_matrix(ntw, S->sim.n_ranges, S->sim.range);
+        if (ntw->connectivity == CONNECTIVITY_STORED
+                        && ntw->encoding == ENCODING_VARINT) {
+                compress_synaptic_matrix(ntw, S->sim.range);
+                if (S->sim.verbose)
+                        report("Synaptic matrix compressed to %.2f bytes per synapse.\n",
+                                        (double) ntw->synapses.byte_offsets[ntw->N]
+                                        / (double) ntw->synapses.n_synapses);
+        }
+}
+
 void free_simulation(struct Simulation *sim) 
 {
-        fclose(sim->spikes_file);
-        fclose(sim->pop_rates_file);
+        if (sim->spikes_file != NULL)
+                fclose(sim->spikes_file);
+        if (sim->pop_rates_file != NULL)
+                fclose(sim->pop_rates_file);
+        for (int k = 0; k < 3; k++)
+                free(sim->rate_trace[k].data);
+        for (int k = 0; k < sim->window_capacity * sim->n_ranges; k++) {
+                free(sim->fired[k].id);
+                free(sim->fired[k].time);
+        }
+        free(sim->fired);
+        free(sim->range);
+        if (sim->archive != NULL) {
+                unmap_spike_archive(sim->archive);
+                free(sim->archive);
+        }
+        if (sim->sorted_trains != NULL)
+                fclose(sim->sorted_trains);
+        free_autocorrelation(sim->autocorrelation);
+}
+
+void run_trial(struct State *S)
+{
+        /* Simulate from the current time up to total_time, flushing the
+         * population rate at the end of every sampling window */
+        struct Simulation *sim = &S->sim;
+
+        if (sim->block_size > 0 && S->ntw.tab_spikes.lag > 0) {
+                run_trial_blocked(S);
+                return;
+        }
+
+        /* The sampling window must be a whole number of time steps */
+        int n_skipped_samples = (int) rint(sim->time_window_size / sim->DT);
+        if (n_skipped_samples < 1)
+                n_skipped_samples = 1;
+        set_time_window_size(S, n_skipped_samples * sim->DT);
+        int iters_since_last_flush = 1;
+
+        while (sim->time < sim->total_time) {
+                simulate_one_step(S);
+                if (iters_since_last_flush == n_skipped_samples) {
+                        flush_population_rate(S);
+                        iters_since_last_flush = 0;
+                        checkpoint_if_due(S);
+                }
+                iters_since_last_flush++;
+        }
+}
+
+void run_trial_blocked(struct State *S)
+{
+        /* Same as run_trial, blocked in time. A spike reaches its targets
+         * lag steps after it is emitted, so over the next lag steps every
+         * neuron only receives spikes that are already in the table. Each
+         * range of neurons is advanced through that whole window (update
+         * and delivery, step by step) before the next one, so that its state
+         * stays in cache, and the spikes of the window are collected
+         * afterwards. Every neuron goes through the same operations in the
+         * same order as in run_trial, so the results are the same. */
+        struct Simulation *sim = &S->sim;
+        struct TableNSpikes *tab = &S->ntw.tab_spikes;
+        int lag = tab->lag;
+        int n_steps;
+        double t, *now;
+
+        /* The sampling window must be a whole number of time steps */
+        int n_skipped_samples = (int) rint(sim->time_window_size / sim->DT);
+        if (n_skipped_samples < 1)
+                n_skipped_samples = 1;
+        set_time_window_size(S, n_skipped_samples * sim->DT);
+        int iters_since_last_flush = 1;
+
+        reserve_spike_lists(sim, lag);
+        now = emalloc(lag * sizeof(double));
+        while (sim->time < sim->total_time) {
+                /* Times at which the steps of the window start, accumulated
+                 * as in run_trial */
+                n_steps = 0;
+                for (t = sim->time; n_steps < lag && t < sim->total_time; t += sim->DT)
+                        now[n_steps++] = t;
+
+#pragma omp parallel num_threads(sim->n_threads) if (sim->n_threads > 1)
+                for (int r = omp_get_thread_num(); r < sim->n_ranges; r += omp_get_num_threads()) {
+                        for (int k = 0; k < n_steps; k++) {
+                                struct SpikeList *f = &sim->fired[k * sim->n_ranges + r];
+                                f->n = sim->integrate(S, now[k], sim->range[r], sim->range[r + 1],
+                                                f->id, f->time);
+                                deliver_spikes(S, (tab->i_delay + k) % tab->size, r);
+                        }
+                }
+
+                for (int k = 0; k < n_steps; k++) {
+                        collect_spikes(S, &sim->fired[k * sim->n_ranges]);
+                        update_pivots(S);
+                        sim->time += sim->DT;
+                        if (iters_since_last_flush == n_skipped_samples) {
+                                flush_population_rate(S);
+                                iters_since_last_flush = 0;
+                        }
+                        iters_since_last_flush++;
+                }
+                /* The state is only whole between windows. A restart resumes
+                 * at the start of a sampling window, so checkpoints are
+                 * taken when both coincide. */
+                if (iters_since_last_flush == 1)
+                        checkpoint_if_due(S);
+        }
+        free(now);
 }
 
 void simulate_one_step(struct State *S)
@@ -130,101 +547,219 @@ void simulate_one_step(struct State *S)
 
 void update_membrane_potentials (struct State *S)
 {
+        /* Each thread updates its own ranges of neurons and records the
+         * spikes of each in its own list. Should the team be smaller than
+         * requested (as may happen to nested teams), threads take more
+         * ranges. */
+        struct Simulation *sim = &S->sim;
+
+#pragma omp parallel num_threads(sim->n_threads) if (sim->n_threads > 1)
+        for (int r = omp_get_thread_num(); r < sim->n_ranges; r += omp_get_num_threads())
+                sim->fired[r].n = sim->integrate(S, sim->time, sim->range[r], sim->range[r + 1],
+                                sim->fired[r].id, sim->fired[r].time);
+        collect_spikes(S, sim->fired);
+}
+
+void collect_spikes(struct State *S, const struct SpikeList *fired_lists)
+{
+        /* Merge the spike lists of all ranges (one step of fired) into the
+         * table of spikes. Ranges are contiguous and increasing, so
+         * concatenating the lists in order leaves the spikes sorted by
+         * neuron index, whatever the number of threads. */
         struct Simulation *sim = &S->sim;
         struct Network *ntw = &S->ntw;
-        struct Neuron *nrn;
+        struct TableNSpikes *t = &ntw->tab_spikes;
+        const struct SpikeList *fired;
+        int n = 0;
+        int j;
 
-        double V_k;
-        int i_curr;
+        for (int r = 0; r < sim->n_ranges; r++)
+                n += fired_lists[r].n;
+        if (n > t->capacity) {
+                grow_table_of_spikes(t, n, ntw->N);
+                if (sim->verbose)
+                        report("\nTable of spikes grown to %d spikes per time step.\n",
+                                        t->capacity);
+        }
 
-        double dt = S->sim.DT;
-        double interpolator;
-        double spike_time;
-        ntw->tab_spikes.num_spikes[ntw->tab_spikes.i_curr] = 0;
-
-        for (int j = 0; j < ntw->N; j++) {
-                nrn = &ntw->cell[j];
-                if ( nrn->ref_state > 0 ) {
-                        nrn->ref_state--;
-                        continue;
-                }
-                V_k = nrn->V_m;
-                nrn->V_m += dt * euler(ntw, nrn, V_k);
-                i_curr = ntw->tab_spikes.i_curr;
-
-                /* Threshold crossing ------------------------- */
-                if ( nrn->V_m >= V_thr ) {
-                        interpolator = (V_thr - V_k) / (nrn->V_m - V_k); /* This should be in [0,1] */
-                        spike_time = sim->time + interpolator * dt;
-                        ntw->tab_spikes.indices[i_curr][ntw->tab_spikes.num_spikes[i_curr]] = j;
-                        if (ntw->tab_spikes.num_spikes[i_curr] >= MAX_SPIKES_PER_DT - 1) {
-                                report("We have %d spikes in a time step, ", 
-                                                ntw->tab_spikes.num_spikes[i_curr]);
-                                report("which is a too big number\nfor the container ");
-                                report("we use to store spike identities.\n Please, increase the");
-                                report("value of MAX_SPIKES_PER_DT and recompile.\n");
-                                exit (2);
-                        }
-                        ntw->tab_spikes.num_spikes[i_curr]++;
-                        if (spike_time > S->sim.offset) {
+        n = 0;
+        for (int r = 0; r < sim->n_ranges; r++) {
+                fired = &fired_lists[r];
+                memcpy(t->indices[t->i_curr] + n, fired->id, fired->n * sizeof(int));
+                n += fired->n;
+                for (int k = 0; k < fired->n; k++) {
+                        j = fired->id[k];
+                        if (fired->time[k] > sim->offset) {
                                 if (j < ntw->NE)
                                         ntw->ne_spikes++;
                                 else 
                                         ntw->ni_spikes++;
+                                ntw->spike_count[j]++;
                         }
-                        push_spike(nrn, spike_time);
-                        nrn->ref_state = ntw->top_ref_state;
-                        nrn->V_m = V_reset 
-                                + dt * euler(ntw, nrn, V_reset) * (1.0 - interpolator); 
+                        if (j < AC_NEURONS)
+                                autocorrelate_spike(sim->autocorrelation, j, fired->time[k]);
+                        if (!keeps_train(ntw, j))
+                                continue;
+                        if (sim->train_stream != NULL && ntw->history.n == HISTORY_CHUNK)
+                                stream_history(S);
+                        record_spike(&ntw->history, j, fired->time[k]);
                 }
         }
-        /* Update currents */
-        for (int j = 0; j < ntw->N; j++) {
-                nrn = &ntw->cell[j];
-                nrn->I_fast *= S->sim.exp_decay_fast;
-        }
-        if (ntw->slow_flag)
-                for (int j = 0; j < ntw->N; j++) {
-                        nrn = &ntw->cell[j];
-                        nrn->I_slow *= S->sim.exp_decay_slow;
-                }
+        t->num_spikes[t->i_curr] = n;
+        if (sim->spike_log != NULL)
+                log_spikes(S, fired_lists);
 }
 
 void send_away_spikes(struct State *S)
 {
+        /* Each thread delivers the delayed spikes to the targets in its own
+         * ranges. Threads never write to the same neuron, and every neuron
+         * receives its inputs in the same order as in a serial run. */
+        struct Simulation *sim = &S->sim;
+        int slot = S->ntw.tab_spikes.i_delay;
+
+#pragma omp parallel num_threads(sim->n_threads) if (sim->n_threads > 1)
+        for (int b = omp_get_thread_num(); b < sim->n_ranges; b += omp_get_num_threads())
+                deliver_spikes(S, slot, b);
+}
+
+void deliver_spikes(struct State *S, int slot, int block)
+{
+        /* Deliver the spikes of the given slot of the table of spikes to the
+         * targets in range block */
         struct Network *ntw = &S->ntw;
-        struct Neuron *source; /* source neuron */
-        struct Neuron *target; /* target neuron */
-        int i_source, i_target, i_delay;
+        const struct SynapticMatrix *m = &ntw->synapses;
+        real *I_fast = ntw->cell.I_fast;
+        real *I_slow = ntw->cell.I_slow;
+        const int *split;
+        int i_source;
         double efficacy;
-        int n_proj_cell;
+        real w_fast, w_slow;
+        size_t first, last;
         double scale_fast = (ntw->tau_m / ntw->tau_fast);
         double scale_slow = (ntw->tau_m / ntw->tau_slow);
 
         double JE = ntw->J;
         double JI = -ntw->g * ntw->J;
 
-        i_delay = ntw->tab_spikes.i_delay;
+        if (ntw->connectivity == CONNECTIVITY_PROCEDURAL) {
+                deliver_spikes_procedural(S, slot, block);
+                return;
+        }
+        if (ntw->encoding == ENCODING_VARINT) {
+                deliver_spikes_varint(S, slot, block);
+                return;
+        }
+
         /* Loop over cells that emitted spikes at t-transmission_delay */
-        for (int j = 0; j < ntw->tab_spikes.num_spikes[i_delay]; j++) {
-                i_source = ntw->tab_spikes.indices[i_delay][j];
-                source = &ntw->cell[i_source];
+        for (int j = 0; j < ntw->tab_spikes.num_spikes[slot]; j++) {
+                i_source = ntw->tab_spikes.indices[slot][j];
                 if (i_source < ntw->NE)
                         efficacy = JE;
                 else
                         efficacy = JI;
-                n_proj_cell = source->synapses.id_projections.n;
-                /* Loop over the projections for this cell */
-                for (int m = 0; m < n_proj_cell; m++) {
-                        i_target = source->synapses.id_projections.data[m];
-                        target = &ntw->cell[i_target];
-                        target->I_fast += efficacy * scale_fast;
+                /* Increments of the currents, in their own precision */
+                w_fast = efficacy * scale_fast;
+                w_slow = efficacy * scale_slow;
+                split = m->split + (size_t) i_source * (m->n_blocks + 1);
+                first = m->offsets[i_source] + split[block];
+                last = m->offsets[i_source] + split[block + 1];
+                /* Loop over the projections for this cell within the block */
+                for (size_t k = first; k < last; k++)
+                        I_fast[m->targets[k]] += w_fast;
+                if (ntw->slow_flag) {
+                        for (size_t k = first; k < last; k++)
+                                I_slow[m->targets[k]] += w_slow;
                 }
+        }
+}
+
+void deliver_spikes_varint(struct State *S, int slot, int block)
+{
+        /* Same as deliver_spikes, decoding the compressed rows. The fast and
+         * slow currents are updated in the same pass, so that each row is
+         * decoded only once. */
+        struct Network *ntw = &S->ntw;
+        const struct SynapticMatrix *m = &ntw->synapses;
+        real *I_fast = ntw->cell.I_fast;
+        real *I_slow = ntw->cell.I_slow;
+        const int *split;
+        const uint8_t *q, *end;
+        int i_source;
+        unsigned target, delta;
+        double efficacy;
+        real w_fast, w_slow;
+        double scale_fast = (ntw->tau_m / ntw->tau_fast);
+        double scale_slow = (ntw->tau_m / ntw->tau_slow);
+
+        double JE = ntw->J;
+        double JI = -ntw->g * ntw->J;
+
+        for (int j = 0; j < ntw->tab_spikes.num_spikes[slot]; j++) {
+                i_source = ntw->tab_spikes.indices[slot][j];
+                if (i_source < ntw->NE)
+                        efficacy = JE;
+                else
+                        efficacy = JI;
+                /* Increments of the currents, in their own precision */
+                w_fast = efficacy * scale_fast;
+                w_slow = efficacy * scale_slow;
+                split = m->split + (size_t) i_source * (m->n_blocks + 1);
+                q = m->bytes + m->byte_offsets[i_source] + split[block];
+                end = m->bytes + m->byte_offsets[i_source] + split[block + 1];
+                target = S->sim.range[block];
                 if (ntw->slow_flag) {
-                        for (int m = 0; m < n_proj_cell; m++) {
-                                i_target = source->synapses.id_projections.data[m];
-                                target = &ntw->cell[i_target];
-                                target->I_slow += efficacy * scale_slow;
+                        while (q < end) {
+                                q = get_varint(q, &delta);
+                                target += delta;
+                                I_fast[target] += w_fast;
+                                I_slow[target] += w_slow;
+                        }
+                } else {
+                        while (q < end) {
+                                q = get_varint(q, &delta);
+                                target += delta;
+                                I_fast[target] += w_fast;
+                        }
+                }
+        }
+}
+
+void deliver_spikes_procedural(struct State *S, int slot, int block)
+{
+        /* Same as deliver_spikes, but the targets of each spiking neuron are
+         * regenerated, one block of neurons at a time */
+        struct Network *ntw = &S->ntw;
+        real *I_fast = ntw->cell.I_fast;
+        real *I_slow = ntw->cell.I_slow;
+        int targets[PROCEDURAL_BLOCK];
+        int i_source, n;
+        double efficacy;
+        real w_fast, w_slow;
+        double scale_fast = (ntw->tau_m / ntw->tau_fast);
+        double scale_slow = (ntw->tau_m / ntw->tau_slow);
+        int first = S->sim.range[block] / PROCEDURAL_BLOCK;
+        int last = (S->sim.range[block + 1] + PROCEDURAL_BLOCK - 1) / PROCEDURAL_BLOCK;
+
+        double JE = ntw->J;
+        double JI = -ntw->g * ntw->J;
+
+        for (int j = 0; j < ntw->tab_spikes.num_spikes[slot]; j++) {
+                i_source = ntw->tab_spikes.indices[slot][j];
+                if (i_source < ntw->NE)
+                        efficacy = JE;
+                else
+                        efficacy = JI;
+                /* Increments of the currents, in their own precision */
+                w_fast = efficacy * scale_fast;
+                w_slow = efficacy * scale_slow;
+                for (int b = first; b < last; b++) {
+                        n = procedural_targets(ntw, i_source, b, targets);
+                        for (int k = 0; k < n; k++)
+                                I_fast[targets[k]] += w_fast;
+                        if (ntw->slow_flag) {
+                                for (int k = 0; k < n; k++)
+                                        I_slow[targets[k]] += w_slow;
                         }
                 }
         }
@@ -239,185 +774,269 @@ void update_pivots(struct State *S)
         ntw->tab_spikes.i_delay %= ntw->tab_spikes.size;
 }
 
-void reset(struct State *S)
+void reset(struct State *S, int trial)
 {
+        /* Prepare a new trial on the same network, with its own initial
+         * conditions */
         S->sim.time = 0;
+        S->sim.next_checkpoint = S->sim.checkpoint_interval;
+        for (int k = 0; k < 3; k++)
+                S->sim.rate_trace[k].n = 0;
+        S->ntw.trial = trial;
+        draw_initial_state(&S->ntw);
         S->ntw.ne_spikes = 0;
         S->ntw.ni_spikes = 0;
         for (int i = 0; i < S->ntw.N; i++)
-                S->ntw.cell[i].spike_train.n = 0;
+                S->ntw.spike_count[i] = 0;
+        clear_history(&S->ntw.history);
+        clear_autocorrelation(S->sim.autocorrelation);
         /* To carry over the spikes from the previous trial,
          * comment out the following loop. */
         struct TableNSpikes *t;
         t = &S->ntw.tab_spikes;
         for (int i = 0; i < t->size; i++)
                 t->num_spikes[i] = 0;
+        t->i_delay = 0;
+        t->i_curr = t->lag;
 }
 
-void fill_population_spike_train(struct State *S, struct Dynamic_Array *poptrain, int n_neurons)
+struct PopulationTrain {
+        /* The spikes of the first n_trains neurons after the offset, merged
+         * in time order as they are needed. Spike j of the merged train is
+         * window[j - base], for base <= j < n; those before keep are no
+         * longer needed and may be dropped. */
+        struct TrainReader *train;
+        double *head;           /* next spike of each train, INFINITY at its end */
+        int n_trains;
+        double *window;
+        size_t base, keep, n, capacity;
+};
+
+static void next_population_head(struct PopulationTrain *p, int i, double offset)
 {
-        /* Fill entries */
-        struct Dynamic_Array *s;
-        int id = 0;
-        for (int i = 0; i < n_neurons; i++) {
-                s = &S->ntw.cell[i].spike_train;
-                for(size_t j = 0; j < s->n; j++)
-                        if (s->data[j] > S->sim.offset) {
-                                poptrain->data[id] = s->data[j];
-                                id++;
-                        }
-        }
-        poptrain->n = id;
+        double t;
+
+        p->head[i] = INFINITY;
+        while (next_spike(&p->train[i], &t))
+                if (t > offset) {
+                        p->head[i] = t;
+                        break;
+                }
 }
 
-void compute_average_autocorrelations(struct State *S)
-/* Compute spike-time autocorrelation */
+static size_t open_population_train(struct State *S, struct PopulationTrain *p, int n_trains)
 {
-        struct Network *ntw = &S->ntw;
-        struct Dynamic_Array *nrn_train;
-        int n_neurons_sample = 1000;
-        size_t num_spikes_total = 0;
-        const size_t n_bins = 201;
-        const double max_lag = 50; /* in ms */
-        double bin_width = 2 * max_lag / (double) n_bins; 
-        char filename[100];
-        gsl_histogram *h = gsl_histogram_alloc(n_bins);
-        gsl_histogram_set_ranges_uniform(h, -max_lag, max_lag);
-        FILE *f;
+        /* Start merging the trains of the first n_trains neurons, and
+         * return how many spikes they have in total, offset or not */
+        size_t n_spikes = 0;
 
-        report("Computing average autocorrelation...\n");
-        sprintf(filename, "autocorrelation_%s", S->sim.suffix);
+        p->n_trains = n_trains;
+        p->train = emalloc(n_trains * sizeof(struct TrainReader));
+        p->head = emalloc(n_trains * sizeof(double));
+        for (int i = 0; i < n_trains; i++) {
+                open_train(S, i, &p->train[i]);
+                n_spikes += p->train[i].length;
+                next_population_head(p, i, S->sim.offset);
+        }
+        p->capacity = 1024;
+        p->window = emalloc(p->capacity * sizeof(double));
+        p->base = p->keep = p->n = 0;
+        return n_spikes;
+}
 
-        double t_sp;
-        size_t l, r;
-        f = fopen(filename, "w");
-        for (int i = 0; i < n_neurons_sample; i++) { 
-                l = 0;
-                r = 0;
-                nrn_train = &ntw->cell[i].spike_train;
-                num_spikes_total += nrn_train->n;
-                for (size_t j = 0; j < nrn_train->n; j++) {
-                        t_sp = nrn_train->data[j];
-                        /* look for left index */
-                        while (l <  nrn_train->n && nrn_train->data[l] < t_sp - max_lag)
-                                l++;
-                        /* look for right index */
-                        while (r < nrn_train->n && nrn_train->data[r] < t_sp + max_lag)
-                                r++;
-                        /* And feed the histogram with the relevant spikes  */
-                        for (size_t k = l; k < r; k++) 
-                                gsl_histogram_increment(h, t_sp - nrn_train->data[k]);
+static bool extend_population_train(struct PopulationTrain *p, double offset)
+{
+        /* Merge the next spike into the window; false if there is none */
+        int first = 0;
+        size_t drop = p->keep - p->base;
+
+        for (int i = 1; i < p->n_trains; i++)
+                if (p->head[i] < p->head[first])
+                        first = i;
+        if (p->n_trains == 0 || p->head[first] == INFINITY)
+                return false;
+        if (p->n - p->base == p->capacity) {
+                if (2 * drop >= p->capacity) {
+                        memmove(p->window, p->window + drop,
+                                        (p->n - p->keep) * sizeof(double));
+                        p->base = p->keep;
+                } else {
+                        p->capacity *= 2;
+                        p->window = erealloc(p->window, p->capacity * sizeof(double));
                 }
         }
-        /* gsl_histogram_fprintf(f, h, "%g", "%g"); */
+        p->window[p->n++ - p->base] = p->head[first];
+        next_population_head(p, first, offset);
+        return true;
+}
+
+static void close_population_train(struct PopulationTrain *p)
+{
+        for (int i = 0; i < p->n_trains; i++)
+                close_train(&p->train[i]);
+        free(p->train);
+        free(p->head);
+        free(p->window);
+}
+
+void average_autocorrelation(struct State *S, double *ac)
+/* Spike-time autocorrelation averaged over a sample of neurons, in AC_BINS
+ * bins up to a lag of AC_MAX_LAG, from the histogram built during the run
+ * (see autocorrelation.c) */
+{
+        int n_neurons_sample = AC_NEURONS;
+        size_t num_spikes_total = S->sim.autocorrelation->n_spikes;
+        const size_t n_bins = AC_BINS;
+        const double max_lag = AC_MAX_LAG; /* in ms */
+        double bin_width = 2 * max_lag / (double) n_bins; 
+        const gsl_histogram *h = S->sim.autocorrelation->h;
+
         /* correct for boundary effects and substract mean */
         double w;
         double T = S->sim.total_time - S->sim.offset;
         /* double nu = num_spikes_total / (T * (double) n_neurons_sample); */
-        double lower, upper, ac;
-        int status;
         for (size_t j = 0; j < n_bins; j++) {
                 w = T - fabs( (n_bins - 1.0) / 2.0 - j ) * bin_width;
-                ac = gsl_histogram_get(h, j) / (w * n_neurons_sample);
-                ac -= (pow(num_spikes_total / (T * n_neurons_sample), 2) * bin_width);
+                ac[j] = gsl_histogram_get(h, j) / (w * n_neurons_sample);
+                ac[j] -= (pow(num_spikes_total / (T * n_neurons_sample), 2) * bin_width);
                 /* ac /= pow(nu * bin_width, 2); [> Normalization <] */
-                status = gsl_histogram_get_range(h, j, &lower, &upper);
-                if (status==0) {
-                        fprintf(f, "% 9.4f % 9.4f % 9.7f\n", lower, upper, ac);
-                } else {
-                        report("Something wrong here.\n");
-                        exit(2);
-                }
         }
-        fclose(f);
-        gsl_histogram_free(h);
 }
 
-void compute_global_autocorrelations(struct State *S)
-/* Compute population rate autocorrelation */
+void global_autocorrelation(struct State *S, double *ac)
+/* Population rate autocorrelation, in AC_BINS bins up to a lag of
+ * GLOBAL_AC_MAX_LAG */
 {
-        struct Network *ntw = &S->ntw;
+        struct PopulationTrain p;
         int n_neurons_sample = 100;
-        const size_t n_bins = 201;
-        const double max_lag = 100; /* maximal lag in ms */
+        const size_t n_bins = AC_BINS;
+        const double max_lag = GLOBAL_AC_MAX_LAG; /* maximal lag in ms */
         double bin_width = 2 * max_lag / (double) n_bins; /* 2*max_lag */
-        char filename[100];
         gsl_histogram *h = gsl_histogram_alloc(n_bins);
         gsl_histogram_set_ranges_uniform(h, -max_lag, max_lag);
-        FILE *f;
-
-        struct Dynamic_Array poptrain;
-        size_t num_spikes_total = 0;
-        for (int i = 0; i < n_neurons_sample; i++)
-                num_spikes_total += ntw->cell[i].spike_train.n;
-        poptrain.data = emalloc(num_spikes_total * sizeof(double));
-        poptrain.n = 0;
-        poptrain.size = num_spikes_total;
-           
-        report("Computing global (population rate) autocorrelation...\n");
-        fill_population_spike_train(S, &poptrain, n_neurons_sample);
 
-        gsl_sort(poptrain.data, 1, num_spikes_total);
-        sprintf(filename, "global_autocorrelation_%s", S->sim.suffix);
+        /* The population train is merged from the trains as the window
+         * moves along it, so that only the spikes within the lags of the
+         * current one are held in memory */
+        size_t num_spikes_total = open_population_train(S, &p, n_neurons_sample);
+        double offset = S->sim.offset;
 
         double t_sp;
-        f = fopen(filename, "w");
         size_t l = 0;
         size_t r = 0;
-        for (size_t j = 0; j < poptrain.n; j++) {
-                t_sp = poptrain.data[j];
+        for (size_t j = 0; j < p.n || extend_population_train(&p, offset); j++) {
+                t_sp = p.window[j - p.base];
                 /* look for left index */
-                while (l < poptrain.n && poptrain.data[l] < t_sp - max_lag)
+                while (l < p.n && p.window[l - p.base] < t_sp - max_lag)
                         l++;
                 /* look for right index */
-                while (r < poptrain.n && poptrain.data[r] < t_sp + max_lag)
+                while ((r < p.n || extend_population_train(&p, offset))
+                                && p.window[r - p.base] < t_sp + max_lag)
                         r++;
                 /* And feed the histogram with the relevant spikes  */
                 for (size_t k = l; k < r; k++) 
-                        gsl_histogram_increment(h, t_sp - poptrain.data[k]);
+                        gsl_histogram_increment(h, t_sp - p.window[k - p.base]);
+                p.keep = l;
         }
-        /* gsl_histogram_fprintf(f, h, "%g", "%g"); */
         /* correct for boundary effects and substract mean */
         double w;
         double T = S->sim.total_time - S->sim.offset;
         /* double nu = num_spikes_total / (T * (double) n_neurons_sample); */
-        double lower, upper, ac;
-        int status;
         for (size_t j = 0; j < n_bins; j++) {
                 w = T - fabs( (n_bins - 1.0) / 2.0 - j ) * bin_width;
-                ac = gsl_histogram_get(h, j) / (w * n_neurons_sample);
-                ac -= (pow(num_spikes_total / (T * n_neurons_sample), 2) * bin_width);
+                ac[j] = gsl_histogram_get(h, j) / (w * n_neurons_sample);
+                ac[j] -= (pow(num_spikes_total / (T * n_neurons_sample), 2) * bin_width);
                 /* ac /= pow(nu * bin_width, 2); [> Normalization <] */
+        }
+        close_population_train(&p);
+        gsl_histogram_free(h);
+}
+
+void write_autocorrelation(const char *filename, double max_lag, const double *ac,
+                int precision)
+{
+        /* Write the AC_BINS bins of an autocorrelation, one per line with
+         * their lower and upper lags */
+        gsl_histogram *h = gsl_histogram_alloc(AC_BINS);
+        gsl_histogram_set_ranges_uniform(h, -max_lag, max_lag);
+        double lower, upper;
+        int status;
+        FILE *f;
+
+        f = fopen(filename, "w");
+        for (size_t j = 0; j < AC_BINS; j++) {
                 status = gsl_histogram_get_range(h, j, &lower, &upper);
                 if (status==0) {
-                        fprintf(f, "% 9.4f % 9.4f % 9.6f\n", lower, upper, ac);
+                        fprintf(f, "% 9.4f % 9.4f % 9.*f\n", lower, upper, precision, ac[j]);
                 } else {
-                        report("Somehting wrong here.\n");
+                        report("Something wrong here.\n");
                         exit(2);
                 }
         }
         fclose(f);
-        free(poptrain.data);
         gsl_histogram_free(h);
 }
 
+void compute_average_autocorrelations(struct State *S)
+/* Compute spike-time autocorrelation */
+{
+        double ac[AC_BINS];
+        char filename[MAX_FILENAME_LENGTH];
+
+        report("Computing average autocorrelation...\n");
+        average_autocorrelation(S, ac);
+        snprintf(filename, sizeof(filename), "autocorrelation_%s", S->sim.suffix);
+        write_autocorrelation(filename, AC_MAX_LAG, ac, 7);
+}
+
+void compute_global_autocorrelations(struct State *S)
+/* Compute population rate autocorrelation */
+{
+        double ac[AC_BINS];
+        char filename[MAX_FILENAME_LENGTH];
+
+        report("Computing global (population rate) autocorrelation...\n");
+        global_autocorrelation(S, ac);
+        snprintf(filename, sizeof(filename), "global_autocorrelation_%s", S->sim.suffix);
+        write_autocorrelation(filename, GLOBAL_AC_MAX_LAG, ac, 6);
+}
+
 void flush_population_rate(struct State *S)
 {
         struct Simulation *sim = &S->sim;
         struct Network *ntw = &S->ntw;
-        double tmp_e, tmp_i;
-        if ( (int) rint(sim->time / sim->DT) % 100 == 0) {
+        /* The rate writer shows the progress itself */
+        if (sim->show_progress && sim->rate_writer == NULL
+                        && (int) rint(sim->time / sim->DT) % 100 == 0) {
                 report("% 9.3f   \r ", sim->time);  
                 fflush(stdout);
         }
-        fprintf(sim->pop_rates_file, "% 9.3f  ", sim->time);
-        tmp_e = ntw->ne_spikes / (double) (sim->time_window_size * ntw->NE);
-        tmp_i = ntw->ni_spikes / (double) (sim->time_window_size * ntw->NI);
-        fprintf(sim->pop_rates_file, "% 9.3f % 9.3f\n", 1e3 * tmp_e, 1e3 * tmp_i);  /* Rates in Hz */
+        record_population_rate(S, sim->time, ntw->ne_spikes, ntw->ni_spikes);
         ntw->ne_spikes = 0;
         ntw->ni_spikes = 0;
 }
 
+void record_population_rate(struct State *S, double time, int ne_spikes, int ni_spikes)
+{
+        /* Write the rates of the window that ends at time, or record them if
+         * this is a trial of a batch */
+        struct Simulation *sim = &S->sim;
+        struct Network *ntw = &S->ntw;
+        double tmp_e, tmp_i;
+        tmp_e = ne_spikes / (double) (sim->time_window_size * ntw->NE);
+        tmp_i = ni_spikes / (double) (sim->time_window_size * ntw->NI);
+        if (sim->record_rates) {
+                push_value(&sim->rate_trace[0], time);
+                push_value(&sim->rate_trace[1], 1e3 * tmp_e);
+                push_value(&sim->rate_trace[2], 1e3 * tmp_i);
+        } else if (sim->rate_writer != NULL) {
+                write_rates(S, time, 1e3 * tmp_e, 1e3 * tmp_i);
+        } else {
+                fprintf(sim->pop_rates_file, "% 9.3f  ", time);
+                fprintf(sim->pop_rates_file, "% 9.3f % 9.3f\n", 1e3 * tmp_e, 1e3 * tmp_i);  /* Rates in Hz */
+        }
+}
+
 double population_rate_E(struct State *S)
 {
         return 1e3 * S->ntw.ne_spikes / (double) (S->ntw.NE * (S->sim.total_time - S->sim.offset));
@@ -433,25 +1052,59 @@ void save_spike_activity(struct State *S)
 {
     /* Draw a sample of neurons from the excitatory and inhibitory populations,
      * and save their spiking activity */
-    struct Dynamic_Array *s;
+    struct TrainReader r;
+    double t;
     int id;
     int n_samples = 100;
     int fraction_ei = (int)(n_samples * S->ntw.NE / S->ntw.N);
     for (int i = 0; i < n_samples; i++) {
             id = (i < fraction_ei) ? i : S->ntw.NE + (i - fraction_ei);
-            s = &S->ntw.cell[id].spike_train;
-            for (size_t k = 0; k < s->n; k++)
-                    fprintf(S->sim.spikes_file, "% 7.3f % 4d\n", s->data[k], id);
+            open_train(S, id, &r);
+            while (next_spike(&r, &t))
+                    fprintf(S->sim.spikes_file, "% 7.3f % 4d\n", t, id);
+            close_train(&r);
     }
 }
 
+void save_final_state(struct State *S)
+{
+        /* Save the synaptic variables at the end of the run. Each point of a
+         * sweep saves them under its own suffix. */
+        char filename[MAX_FILENAME_LENGTH];
+
+        if (sweep_points(&S->sim.sweep) > 0)
+                snprintf(filename, sizeof(filename), "synaptic_variables_at_end_%s",
+                                S->sim.suffix);
+        else
+                sprintf(filename, "synaptic_variables_at_end.dat");
+        save_pdfs_synaptic_vars(&S->ntw, filename);
+}
+
+void mean_rates(struct State *S, double *rate_e, double *rate_i)
+{
+        /* Mean rates of both populations after the offset, from the spike
+         * counts */
+        struct Network *ntw = &S->ntw;
+        double T = S->sim.total_time - S->sim.offset;
+        size_t n_e = 0, n_i = 0;
+
+        for (int i = 0; i < ntw->N; i++) {
+                if (i < ntw->NE)
+                        n_e += ntw->spike_count[i];
+                else
+                        n_i += ntw->spike_count[i];
+        }
+        *rate_e = 1e3 * n_e / (ntw->NE * T);
+        *rate_i = 1e3 * n_i / (ntw->NI * T);
+}
+
 void save_individual_firing_rates(struct State *S)
 {
         struct Simulation *sim = &S->sim;
         struct Network *ntw = &S->ntw;
         for (int i = 0; i < ntw->N; i++) {
                 fprintf(sim->indiv_rates_file, "% 2d % 8.2f\n", i, 
-                                1e3 * (ntw->cell[i].spike_train.n) / sim->time);
+                                1e3 * ntw->spike_count[i] / (sim->time - sim->offset));
         }
 }
 
@@ -471,10 +1124,21 @@ void show_parameters(struct State *S)
         printf("       g, |JI| / |JE|             = % 6.2f\n", ntw->g);
         printf("       t, synaptic time constant  = % 6.2f\n", ntw->tau_fast);
         if (ntw->slow_flag)
-                printf("       s, slow synaptic time constant  = % 6.2f\n", ntw->tau_slow);
+                printf("          slow synaptic constant  = % 6.2f\n", ntw->tau_slow);
         printf("       D, synaptic delay          = % 6.2f\n", ntw->delay);
-        printf("       I, external input          = % 6.2f\n\n", ntw->ext_current);
+        printf("       I, external input          = % 6.2f\n", ntw->ext_current);
+        printf("       s, sampling of connections =  %s\n", sampling_name(ntw->sampling));
+        printf("       p, connectivity            =  %s\n", connectivity_name(ntw->connectivity));
+        printf("       e, encoding of synapses    =  %s\n", encoding_name(ntw->encoding));
+        printf("       S, seed                    =  %lu\n\n", ntw->seed);
         printf("   Simulation parameters\n");
         printf("       Time step                  = % 6.2f\n", sim->DT);
+        printf("       Integration scheme         =  %s\n", integrator_name(sim->integrator));
+        printf("       Membrane update kernel     =  %s\n", kernel_name(sim->kernel));
+        printf("       Number of threads          = % 6d\n", sim->n_threads);
         printf("       Total simulated time       = % 6d\n", (int)sim->total_time);
+        if (sim->n_trials > 1)
+                printf("       Trials                     = % 6d\n", sim->n_trials);
+        if (sweep_points(&sim->sweep) > 0)
+                printf("       Points of the sweep        = % 6d\n", sweep_points(&sim->sweep));
 }
@@ -1,28 +1,140 @@
 #ifndef _SIMULATION_H
 #define _SIMULATION_H 1
 
-#define MAX_SUFFIX_LENGTH 70
+#define MAX_SUFFIX_LENGTH 160
+#define MAX_FILENAME_LENGTH (MAX_SUFFIX_LENGTH + 32)   /* prefix_<suffix> */
+
+/* Autocorrelations are histograms of this many bins, centered at lag 0 and
+ * extending to the maximal lag on both sides (in ms) */
+#define AC_BINS 201
+#define AC_MAX_LAG 50           /* spike-time autocorrelation */
+#define AC_NEURONS 1000         /* neurons it is averaged over */
+#define GLOBAL_AC_MAX_LAG 100   /* population rate autocorrelation */
 #include <getopt.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <gsl/gsl_histogram.h>
 #include <gsl/gsl_sort.h>
 #include "network.h"
 #include "parameters.h"
 
+/* Membrane update kernels, see kernels.c */
+enum Kernel { KERNEL_AUTO, KERNEL_SCALAR, KERNEL_AVX2, KERNEL_AVX512 };
+
+/* Integration schemes for the membrane potential */
+enum Integrator { INTEGRATOR_EULER, INTEGRATOR_EXACT };
+
+/* Parameters that can be swept over, see sweep.c. None of them changes
+ * the connectivity. */
+enum SweepParameter {
+    SWEEP_EXT_CURRENT,
+    SWEEP_G,
+    SWEEP_J,
+    SWEEP_DELAY,
+    N_SWEEP_PARAMETERS
+};
+
+#define MAX_SWEEP_VALUES 256
+
+struct Sweep {
+    /* Values of each parameter, or none if it is not swept */
+    int n_values[N_SWEEP_PARAMETERS];
+    double values[N_SWEEP_PARAMETERS][MAX_SWEEP_VALUES];
+    /* Points simulated at once; 0 for as many as the cores allow */
+    int n_workers;
+};
+
+struct State;
+struct SpikeLog;
+typedef int (*integrate_kernel)(struct State *S, double now, int begin, int end,
+                int *ids, double *times);
+
+struct SpikeList {
+    /* Neurons that crossed threshold in the current time step, in
+     * increasing order, and their spike times */
+    int n;
+    int *id;
+    double *time;
+};
+
 struct Simulation {
     double time;
     double offset; /* offset after which we start considering spike times */
     double DT;
     double exp_decay_slow;
     double exp_decay_fast;
+    /* Exact propagator over one time step: without spikes,
+     * V(t + DT) = prop_mm V(t) + prop_ext + prop_fast I_fast(t) + prop_slow I_slow(t) */
+    enum Integrator integrator;
+    double prop_mm;
+    double prop_ext;
+    double prop_fast;
+    double prop_slow;
     double total_time;
     double time_window_size;
     char config_file[MAX_SUFFIX_LENGTH];
     char suffix[MAX_SUFFIX_LENGTH];
     FILE *spikes_file;
     FILE *pop_rates_file;
+    struct RateWriter *rate_writer;  /* writes pop_rates_file, see ratewriter.c */
     FILE *indiv_rates_file;
     _Bool verbose;
+    bool show_progress;          /* report the time as the run goes */
+    enum Kernel kernel;          /* requested kernel */
+    integrate_kernel integrate;  /* kernel actually used */
+    /* Threads. The local neurons are split into n_ranges contiguous ranges,
+     * range r holding neurons range[r], ..., range[r + 1] - 1; thread t
+     * updates ranges t, t + n_threads, ... There is one range per thread,
+     * unless the run is blocked in time (see run_trial_blocked), in which
+     * case ranges hold about block_size neurons. The spikes of range r in
+     * the k-th step of a window go to fired[k * n_ranges + r], for up to
+     * window_capacity steps. */
+    int n_threads;
+    int n_ranges;
+    int *range;
+    int block_size;
+    int window_capacity;
+    struct SpikeList *fired;
+    /* Checkpoints, see checkpoint.c. The interval is in ms of simulated
+     * time; checkpoints are disabled if it is zero or there is no file. */
+    char checkpoint_file[MAX_PATH_LENGTH];
+    char restart_file[MAX_PATH_LENGTH];
+    double checkpoint_interval;
+    double next_checkpoint;
+    pthread_t checkpoint_writer;
+    bool checkpoint_pending;
+    /* Trials on the same network, see batch.c. Up to concurrent_trials of
+     * them run at once, each on n_threads threads. A trial of a batch
+     * records its population rates (times, E and I rates) in rate_trace
+     * instead of writing them. */
+    int n_trials;
+    int concurrent_trials;
+    bool record_rates;
+    struct Dynamic_Array rate_trace[3];
+    /* Grid of parameters, see sweep.c */
+    struct Sweep sweep;
+    /* Processes the network is distributed over, and the rank of this
+     * one, see distributed.c */
+    int n_processes;
+    int rank;
+    /* Binary record of the spikes, of the sampled neurons or all of them,
+     * see spikelog.c */
+    char spike_record_file[MAX_PATH_LENGTH];
+    bool record_all;
+    struct SpikeLog *spike_log;
+    int64_t spike_log_offset;   /* its length at the restart checkpoint */
+    /* Spike history streamed to disk in chunks, and then sorted by neuron
+     * at the end of the run, see trainstream.c */
+    bool stream_trains;
+    FILE *train_stream;
+    FILE *sorted_trains;
+    /* Archive of the spike trains written at the end of the run, and its
+     * mapping, which the analyses then read; see spikearchive.c */
+    char spike_archive_file[MAX_PATH_LENGTH];
+    struct SpikeArchive *archive;
+    /* Autocorrelation of single neurons, built as they spike, see
+     * autocorrelation.c */
+    struct SpikeAutocorrelation *autocorrelation;
 };
 
 struct State {
@@ -37,24 +149,42 @@ void create_suffix(struct State *S, char *sfx);
 void open_file_handlers(struct State *S);
 void write_header(FILE* dev, struct State *S);
 void setup_state(struct State *S);
+void clone_state(struct State *dst, const struct State *src);
 void free_state(struct State *S);
 void set_total_time(struct State *S, double T);
 void set_offset(struct State *S, double offset);
 void set_dt(struct State *S, double d);
 void set_time_window_size(struct State *S, double w);
 int initialize_network(struct State *S);
+void set_propagator(struct State *S);
+void set_local_range(struct State *S);
+void partition_network(struct State *S);
+void build_connectivity(struct State *S);
 void free_simulation(struct Simulation *sim);
+void run_trial(struct State *S);
+void run_trial_blocked(struct State *S);
+void reserve_spike_lists(struct Simulation *sim, int n_steps);
 void simulate_one_step(struct State *S);
 void update_membrane_potentials(struct State *S);
+void collect_spikes(struct State *S, const struct SpikeList *fired);
 void send_away_spikes(struct State *S);
+void deliver_spikes(struct State *S, int slot, int block);
+void deliver_spikes_varint(struct State *S, int slot, int block);
+void deliver_spikes_procedural(struct State *S, int slot, int block);
 void update_pivots(struct State *S);
-void fill_population_spike_train(struct State *S, struct Dynamic_Array *poptrain, int n_neurons);
+void average_autocorrelation(struct State *S, double *ac);
+void global_autocorrelation(struct State *S, double *ac);
+void write_autocorrelation(const char *filename, double max_lag, const double *ac,
+                int precision);
 void compute_average_autocorrelations(struct State *S);
 void compute_global_autocorrelations(struct State *S);
 void flush_population_rate(struct State *S);
+void record_population_rate(struct State *S, double time, int ne_spikes, int ni_spikes);
 double population_rate(struct State *S);
-void reset(struct State *S);
+void reset(struct State *S, int trial);
 void save_spike_activity(struct State *S);
+void save_final_state(struct State *S);
+void mean_rates(struct State *S, double *rate_e, double *rate_i);
 void save_individual_firing_rates(struct State *S);
 void show_parameters(struct State *S);
 #endif
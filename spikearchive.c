@@ -0,0 +1,222 @@
+/* Spike trains archived at the end of a run.
+ *
+ * The spike file holds the spikes of a sample of neurons as text, which
+ * has to be parsed again every time it is analyzed. The archive holds the
+ * trains of all analyzed neurons in binary, grouped by neuron, with an
+ * index and the parameters of the run (see spikearchive.h), so that it can
+ * be mapped and any train, or any time window of it, read in place without
+ * parsing or copying (see archive_train and archive_window).
+ *
+ * The archive is the index of the spike history (see index_history) as it
+ * is laid out in memory, written behind a header; in a streamed run, the
+ * times are copied from the sorted file instead (see trainstream.c). The
+ * analyses of a run read the trains through open_train, from that sorted
+ * file in a streamed run, and otherwise from spike_trains, which gives the
+ * mapped archive if there is one, and the history itself otherwise. */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "simulation.h"
+#include "spikearchive.h"
+
+#define ARCHIVE_BLOCK 65536     /* spike times copied at once from a sorted file */
+
+static void fill_archive_header(const struct State *S, struct SpikeArchiveHeader *h)
+{
+        const struct Network *ntw = &S->ntw;
+
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, SPIKE_ARCHIVE_MAGIC, sizeof(SPIKE_ARCHIVE_MAGIC));
+        h->version = SPIKE_ARCHIVE_VERSION;
+        h->N = ntw->N;
+        h->NE = ntw->NE;
+        h->C = ntw->C;
+        h->slow_flag = ntw->slow_flag;
+        h->J = ntw->J;
+        h->ext_current = ntw->ext_current;
+        h->g = ntw->g;
+        h->DT = S->sim.DT;
+        h->tau_m = ntw->tau_m;
+        h->tau_rp = ntw->tau_rp;
+        h->delay = ntw->delay;
+        h->tau_fast = ntw->tau_fast;
+        h->tau_slow = ntw->tau_slow;
+        h->offset = S->sim.offset;
+        h->total_time = S->sim.total_time;
+}
+
+void spike_trains(struct State *S, struct SpikeArchive *a)
+{
+        /* The spike trains of the run, from the archive if it is mapped */
+        struct SpikeHistory *h = &S->ntw.history;
+
+        if (S->sim.archive != NULL) {
+                *a = *S->sim.archive;
+                return;
+        }
+        index_history(&S->ntw);
+        a->header = NULL;
+        a->N = S->ntw.N;
+        a->first = h->first;
+        a->times = h->times;
+        a->map = NULL;
+        a->map_size = 0;
+}
+
+static int copy_sorted_trains(struct State *S, FILE *f, uint64_t n_spikes,
+                uint64_t *checksum)
+{
+        /* Append the n_spikes times of the sorted file of a streamed run to
+         * f, a block at a time, and carry on the checksum over them */
+        int fd = fileno(S->sim.sorted_trains);
+        double *block = emalloc(ARCHIVE_BLOCK * sizeof(double));
+        size_t n, size;
+        int ok = 1;
+
+        for (uint64_t k = 0; ok && k < n_spikes; k += n) {
+                n = n_spikes - k < ARCHIVE_BLOCK ? n_spikes - k : ARCHIVE_BLOCK;
+                size = n * sizeof(double);
+                ok = pread(fd, block, size, (off_t) (k * sizeof(double))) == (ssize_t) size
+                        && fwrite(block, sizeof(double), n, f) == n;
+                *checksum = fnv_checksum(block, size, *checksum);
+        }
+        free(block);
+        return ok;
+}
+
+int save_spike_archive(struct State *S, const char *path)
+{
+        /* Write the spike history to path, under a temporary name that is
+         * renamed when complete. Returns 0 on success. */
+        struct SpikeHistory *hist = &S->ntw.history;
+        struct SpikeArchiveHeader h;
+        char tmp[MAX_PATH_LENGTH + 32];
+        size_t n_index = S->ntw.N + 1;
+        FILE *f;
+        int ok;
+
+        /* The history of a streamed run is already indexed, on disk */
+        if (S->sim.sorted_trains == NULL)
+                index_history(&S->ntw);
+        fill_archive_header(S, &h);
+        h.n_spikes = hist->first[S->ntw.N];
+        h.checksum = fnv_checksum(hist->first, n_index * sizeof(uint64_t),
+                        0xcbf29ce484222325ULL);
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long) getpid());
+        if ((f = fopen(tmp, "wb")) == NULL) {
+                weprintf("cannot write spike archive '%s':", tmp);
+                return -1;
+        }
+        /* The header is written again at the end, with the checksum */
+        ok = fwrite(&h, sizeof(h), 1, f) == 1
+                && fwrite(hist->first, sizeof(uint64_t), n_index, f) == n_index;
+        if (S->sim.sorted_trains == NULL) {
+                h.checksum = fnv_checksum(hist->times, h.n_spikes * sizeof(double),
+                                h.checksum);
+                ok = ok && fwrite(hist->times, sizeof(double), h.n_spikes, f) == h.n_spikes;
+        } else {
+                ok = ok && copy_sorted_trains(S, f, h.n_spikes, &h.checksum);
+        }
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmp, path) != 0) {
+                weprintf("cannot write spike archive '%s':", path);
+                remove(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+int map_spike_archive(struct SpikeArchive *a, const char *path)
+{
+        /* Map the archive in path, read-only, after checking it whole.
+         * Returns 0 on success. */
+        const struct SpikeArchiveHeader *h;
+        struct stat st;
+        char *base;
+        void *map;
+        size_t size;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY)) < 0) {
+                weprintf("cannot open spike archive '%s':", path);
+                return -1;
+        }
+        if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*h)) {
+                report("'%s' is not a spike archive.\n", path);
+                close(fd);
+                return -1;
+        }
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                weprintf("cannot map spike archive '%s':", path);
+                return -1;
+        }
+
+        h = map;
+        base = (char *) map + sizeof(*h);
+        if (memcmp(h->magic, SPIKE_ARCHIVE_MAGIC, sizeof(SPIKE_ARCHIVE_MAGIC)) != 0
+                        || h->version != SPIKE_ARCHIVE_VERSION || h->N < 0
+                        || size != sizeof(*h) + (h->N + 1) * sizeof(uint64_t)
+                        + h->n_spikes * sizeof(double)) {
+                report("'%s' is not a spike archive.\n", path);
+                munmap(map, size);
+                return -1;
+        }
+        if (fnv_checksum(base, size - sizeof(*h), 0xcbf29ce484222325ULL) != h->checksum) {
+                report("'%s' is corrupt.\n", path);
+                munmap(map, size);
+                return -1;
+        }
+
+        a->header = h;
+        a->N = h->N;
+        a->first = (const uint64_t *) base;
+        a->times = (const double *) (base + (h->N + 1) * sizeof(uint64_t));
+        a->map = map;
+        a->map_size = size;
+        return 0;
+}
+
+void unmap_spike_archive(struct SpikeArchive *a)
+{
+        if (a->map != NULL)
+                munmap(a->map, a->map_size);
+        a->map = NULL;
+}
+
+void archive_spike_trains(struct State *S)
+{
+        /* Save the archive of the run, if asked for, and map it for the
+         * analyses that follow. Those of a streamed run read its sorted
+         * file instead, a block at a time: the mapping would end up holding
+         * the whole history in memory. */
+        struct Simulation *sim = &S->sim;
+        struct SpikeArchive *a;
+
+        if (sim->spike_archive_file[0] == '\0')
+                return;
+        if (save_spike_archive(S, sim->spike_archive_file) != 0)
+                return;
+        if (sim->sorted_trains != NULL) {
+                if (sim->verbose)
+                        report("%llu spikes archived in '%s'.\n",
+                                        (unsigned long long) S->ntw.history.first[S->ntw.N],
+                                        sim->spike_archive_file);
+                return;
+        }
+        a = emalloc(sizeof(*a));
+        if (map_spike_archive(a, sim->spike_archive_file) != 0) {
+                free(a);
+                return;
+        }
+        sim->archive = a;
+        if (sim->verbose)
+                report("%llu spikes archived in '%s'.\n",
+                                (unsigned long long) a->header->n_spikes, sim->spike_archive_file);
+}
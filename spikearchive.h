@@ -0,0 +1,93 @@
+#ifndef _SPIKEARCHIVE_H
+#define _SPIKEARCHIVE_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Spike archive, see spikearchive.c. A file holds a header, the index of
+ * the spike trains (N + 1 offsets) and then the spike times of all trains,
+ * neuron after neuron: the train of neuron i is times[first[i]], ...,
+ * times[first[i + 1] - 1], in order. Trains are empty for the neurons that
+ * are not analyzed (see keeps_train). The checksum covers everything after
+ * the header. */
+struct SpikeArchiveHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t N;
+        int32_t NE;
+        int32_t C;
+        int32_t slow_flag;      /* whether tau_slow applies */
+        int32_t reserved;
+        double J;
+        double ext_current;
+        double g;
+        double DT;
+        double tau_m;
+        double tau_rp;
+        double delay;
+        double tau_fast;
+        double tau_slow;
+        double offset;          /* analyses ignore the spikes before it */
+        double total_time;
+        uint64_t n_spikes;
+        uint64_t checksum;
+};
+
+#define SPIKE_ARCHIVE_MAGIC "LIFARCH"
+#define SPIKE_ARCHIVE_VERSION 1
+
+struct SpikeArchive {
+        /* A mapped archive, or the spike history of a run seen as one (then
+         * header and map are NULL) */
+        const struct SpikeArchiveHeader *header;
+        int N;
+        const uint64_t *first;
+        const double *times;
+        void *map;
+        size_t map_size;
+};
+
+struct State;
+
+/* spikearchive.c */
+void spike_trains(struct State *S, struct SpikeArchive *a);
+int save_spike_archive(struct State *S, const char *path);
+int map_spike_archive(struct SpikeArchive *a, const char *path);
+void unmap_spike_archive(struct SpikeArchive *a);
+void archive_spike_trains(struct State *S);
+
+/* Spike train of neuron i: n spike times, in order */
+static inline const double *archive_train(const struct SpikeArchive *a, int i, size_t *n)
+{
+        *n = a->first[i + 1] - a->first[i];
+        return a->times + a->first[i];
+}
+
+/* The spikes of neuron i between t0 (included) and t1 (excluded) */
+static inline const double *archive_window(const struct SpikeArchive *a, int i,
+                double t0, double t1, size_t *n)
+{
+        size_t length, lo = 0, hi, mid, end;
+        const double *t = archive_train(a, i, &length);
+
+        hi = length;
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (t[mid] < t0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        end = lo;
+        hi = length;
+        while (end < hi) {
+                mid = end + (hi - end) / 2;
+                if (t[mid] < t1)
+                        end = mid + 1;
+                else
+                        hi = mid;
+        }
+        *n = end - lo;
+        return t + lo;
+}
+#endif
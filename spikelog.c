@@ -0,0 +1,243 @@
+/* Spikes recorded in binary as the run goes.
+ *
+ * save_spike_activity writes the spikes of a sample of neurons as text, at
+ * the end of the run. With a spike record file, the spikes are also written
+ * during the run, as 12-byte binary records (see spikelog.h), either for
+ * the same sample of neurons or for all of them. Formatting millions of
+ * spikes as text would take longer than simulating them.
+ *
+ * Records are appended to one of two blocks. When a block is full it is
+ * handed to a writer thread, and the simulation goes on filling the other
+ * one; it only waits if the writer is still busy with it. print_spikes
+ * turns a record file back into text.
+ *
+ * Checkpoints keep the length of the record, so that a restarted run
+ * continues it from there (see reopen_spike_log). */
+#include <pthread.h>
+#include <unistd.h>
+#include "simulation.h"
+#include "spikelog.h"
+
+#define SPIKE_LOG_BLOCK (1 << 16)       /* records per block */
+
+struct SpikeLog {
+        FILE *f;
+        bool all;
+        struct SpikeRecord *block[2];
+        size_t n[2];
+        int active;             /* block being filled */
+        bool full[2];           /* blocks handed to the writer */
+        bool done;
+        pthread_t writer;
+        bool threaded;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        uint64_t n_records;
+        bool failed;
+};
+
+static void write_block(struct SpikeLog *log, int b)
+{
+        if (fwrite(log->block[b], sizeof(struct SpikeRecord), log->n[b], log->f) != log->n[b])
+                log->failed = true;
+}
+
+static void *spike_writer(void *arg)
+{
+        /* Write the blocks in the order they are filled, until told to
+         * stop */
+        struct SpikeLog *log = arg;
+        int b = 0;
+
+        pthread_mutex_lock(&log->lock);
+        for (;;) {
+                while (!log->full[b] && !log->done)
+                        pthread_cond_wait(&log->cond, &log->lock);
+                if (!log->full[b])
+                        break;
+                pthread_mutex_unlock(&log->lock);
+                write_block(log, b);
+                pthread_mutex_lock(&log->lock);
+                log->full[b] = false;
+                pthread_cond_broadcast(&log->cond);
+                b ^= 1;
+        }
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+}
+
+static void hand_over(struct SpikeLog *log)
+{
+        /* Give the active block to the writer and take the other one */
+        int b = log->active;
+
+        if (!log->threaded) {
+                write_block(log, b);
+                log->n[b] = 0;
+                return;
+        }
+        pthread_mutex_lock(&log->lock);
+        log->full[b] = true;
+        pthread_cond_broadcast(&log->cond);
+        b ^= 1;
+        while (log->full[b])
+                pthread_cond_wait(&log->cond, &log->lock);
+        pthread_mutex_unlock(&log->lock);
+        log->active = b;
+        log->n[b] = 0;
+}
+
+static FILE *reopen_spike_log(struct State *S, const struct SpikeLogHeader *h,
+                uint64_t *n_records)
+{
+        /* Open the record of the run up to the restart checkpoint, without
+         * the spikes recorded after it; NULL if it cannot be continued */
+        struct Simulation *sim = &S->sim;
+        struct SpikeLogHeader old;
+        int64_t offset = sim->spike_log_offset;
+        FILE *f;
+
+        if (offset < (int64_t) sizeof(old)
+                        || (offset - sizeof(old)) % sizeof(struct SpikeRecord) != 0)
+                return NULL;
+        if ((f = fopen(sim->spike_record_file, "r+b")) == NULL)
+                return NULL;
+        if (fread(&old, sizeof(old), 1, f) != 1 || memcmp(&old, h, sizeof(old)) != 0
+                        || fseek(f, 0, SEEK_END) != 0 || ftell(f) < offset
+                        || ftruncate(fileno(f), offset) != 0 || fseek(f, offset, SEEK_SET) != 0) {
+                fclose(f);
+                return NULL;
+        }
+        *n_records = (offset - sizeof(old)) / sizeof(struct SpikeRecord);
+        return f;
+}
+
+void open_spike_log(struct State *S)
+{
+        /* Start recording spikes, if there is a spike record file */
+        struct Simulation *sim = &S->sim;
+        struct SpikeLogHeader h;
+        struct SpikeLog *log;
+
+        sim->spike_log = NULL;
+        if (sim->spike_record_file[0] == '\0')
+                return;
+        log = emalloc(sizeof(*log));
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SPIKE_LOG_MAGIC, sizeof(SPIKE_LOG_MAGIC));
+        h.version = SPIKE_LOG_VERSION;
+        h.N = S->ntw.N;
+        h.NE = S->ntw.NE;
+        h.all = sim->record_all;
+        h.DT = sim->DT;
+        log->f = NULL;
+        log->n_records = 0;
+        if (sim->restart_file[0] != '\0'
+                        && (log->f = reopen_spike_log(S, &h, &log->n_records)) == NULL)
+                report("The spike record '%s' cannot be continued from the checkpoint; "
+                                "recording from t = %.3f ms in a new one.\n",
+                                sim->spike_record_file, sim->time);
+        if (log->f == NULL) {
+                if ((log->f = fopen(sim->spike_record_file, "wb")) == NULL)
+                        eprintf("cannot open '%s':", sim->spike_record_file);
+                if (fwrite(&h, sizeof(h), 1, log->f) != 1)
+                        eprintf("cannot write '%s':", sim->spike_record_file);
+        }
+
+        log->all = sim->record_all;
+        for (int b = 0; b < 2; b++) {
+                log->block[b] = emalloc(SPIKE_LOG_BLOCK * sizeof(struct SpikeRecord));
+                log->n[b] = 0;
+                log->full[b] = false;
+        }
+        log->active = 0;
+        log->done = false;
+        log->failed = false;
+        pthread_mutex_init(&log->lock, NULL);
+        pthread_cond_init(&log->cond, NULL);
+        /* Without a thread, blocks are written as they fill */
+        log->threaded = pthread_create(&log->writer, NULL, spike_writer, log) == 0;
+        sim->spike_log = log;
+}
+
+static bool sampled(const struct Network *ntw, int id)
+{
+        /* The neurons of save_spike_activity */
+        int fraction_ei = (int) (100 * ntw->NE / ntw->N);
+
+        return id < fraction_ei || (id >= ntw->NE && id < ntw->NE + 100 - fraction_ei);
+}
+
+void log_spikes(struct State *S, const struct SpikeList *fired)
+{
+        /* Record the spikes of the current time step, the lists of all
+         * ranges in fired */
+        struct SpikeLog *log = S->sim.spike_log;
+        struct SpikeRecord *r;
+        int step = (int) rint(S->sim.time / S->sim.DT);
+        double start = step * S->sim.DT;
+
+        for (int k = 0; k < S->sim.n_ranges; k++) {
+                for (int j = 0; j < fired[k].n; j++) {
+                        if (!log->all && !sampled(&S->ntw, fired[k].id[j]))
+                                continue;
+                        if (log->n[log->active] == SPIKE_LOG_BLOCK)
+                                hand_over(log);
+                        r = &log->block[log->active][log->n[log->active]++];
+                        r->step = step;
+                        r->offset = (float) (fired[k].time[j] - start);
+                        r->id = fired[k].id[j];
+                        log->n_records++;
+                }
+        }
+}
+
+long flush_spike_log(struct State *S)
+{
+        /* Wait until every spike recorded is in the file, and return its
+         * length; -1 without a spike record */
+        struct SpikeLog *log = S->sim.spike_log;
+
+        if (log == NULL)
+                return -1;
+        if (log->n[log->active] > 0)
+                hand_over(log);
+        if (log->threaded) {
+                pthread_mutex_lock(&log->lock);
+                while (log->full[0] || log->full[1])
+                        pthread_cond_wait(&log->cond, &log->lock);
+                pthread_mutex_unlock(&log->lock);
+        }
+        if (fflush(log->f) != 0)
+                log->failed = true;
+        return ftell(log->f);
+}
+
+void close_spike_log(struct State *S)
+{
+        /* Write what is left and stop the writer */
+        struct SpikeLog *log = S->sim.spike_log;
+
+        if (log == NULL)
+                return;
+        if (log->n[log->active] > 0)
+                hand_over(log);
+        if (log->threaded) {
+                pthread_mutex_lock(&log->lock);
+                log->done = true;
+                pthread_cond_broadcast(&log->cond);
+                pthread_mutex_unlock(&log->lock);
+                pthread_join(log->writer, NULL);
+        }
+        if (fclose(log->f) != 0 || log->failed)
+                weprintf("cannot write '%s':", S->sim.spike_record_file);
+        else if (S->sim.verbose)
+                report("%llu spikes recorded in '%s'.\n",
+                                (unsigned long long) log->n_records, S->sim.spike_record_file);
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->cond);
+        free(log->block[0]);
+        free(log->block[1]);
+        free(log);
+        S->sim.spike_log = NULL;
+}
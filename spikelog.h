@@ -0,0 +1,35 @@
+#ifndef _SPIKELOG_H
+#define _SPIKELOG_H 1
+
+#include <stdint.h>
+
+/* Binary spike records, see spikelog.c. A file holds a header followed by
+ * one record per spike, in the order of the simulation: by time step, then
+ * by neuron. The time of a spike is step * DT + offset (in ms). */
+struct SpikeLogHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t N;
+        int32_t NE;
+        int32_t all;            /* all neurons, or only the sampled ones */
+        double DT;
+};
+
+struct SpikeRecord {
+        int32_t step;
+        float offset;
+        int32_t id;
+};
+
+#define SPIKE_LOG_MAGIC "LIFSPK"
+#define SPIKE_LOG_VERSION 1
+
+struct State;
+struct SpikeList;
+
+/* spikelog.c */
+void open_spike_log(struct State *S);
+void log_spikes(struct State *S, const struct SpikeList *fired);
+long flush_spike_log(struct State *S);
+void close_spike_log(struct State *S);
+#endif
@@ -0,0 +1,223 @@
+/* Sweeps over a grid of parameters.
+ *
+ * The grid is given in the configuration file, with one line per swept
+ * parameter that lists its values, either one by one or as first:step:last:
+ *
+ *     sweep_ext_current = 20:2:30
+ *     sweep_g = 4, 4.5, 5
+ *
+ * The external current, g, J and the delay can be swept. None of them
+ * changes the connectivity, so the synaptic matrix is built (or mapped from
+ * the connectivity file) once and shared by all points. A pool of workers
+ * takes the points one by one, each worker simulating on a State of its own
+ * (see clone_state). Every point writes the files of a single run, or of a
+ * batch of trials, under its own suffix (see open_file_handlers), and
+ * sweep_rates.dat collects the mean rates of all points. */
+#include "sweep.h"
+#include "batch.h"
+#include "ratewriter.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+static inline int omp_get_thread_num(void) { return 0; }
+static inline int omp_get_num_procs(void) { return 1; }
+static inline void omp_set_max_active_levels(int n) { (void) n; }
+#endif
+
+struct PointResult {
+        double value[N_SWEEP_PARAMETERS];
+        double rate_e;
+        double rate_i;
+};
+
+int parse_sweep_values(const char *s, double *v, int max)
+{
+        /* Read the values in s, either listed (separated by commas or
+         * blanks) or as first:step:last, into v. Return how many. */
+        double first, step, last;
+        char *end;
+        int n = 0;
+
+        if (sscanf(s, "%lf:%lf:%lf", &first, &step, &last) == 3) {
+                if (step == 0 || (last - first) / step < 0) {
+                        report("Invalid range '%s'.\n", s);
+                        return 0;
+                }
+                for (n = 0; n < max && n <= (last - first) / step + 1e-9; n++)
+                        v[n] = first + n * step;
+        } else {
+                while (n < max) {
+                        while (*s == ',' || *s == ' ' || *s == '\t')
+                                s++;
+                        v[n] = strtod(s, &end);
+                        if (end == s)
+                                break;
+                        s = end;
+                        n++;
+                }
+                if (*s != '\0') {
+                        report("Invalid value in '%s'.\n", s);
+                        return 0;
+                }
+        }
+        if (n == max)
+                report("Only the first %d values of a sweep are used.\n", max);
+        return n;
+}
+
+int sweep_points(const struct Sweep *sw)
+{
+        /* Number of points of the grid, or 0 if nothing is swept */
+        int n = 1;
+        bool swept = false;
+
+        for (int k = 0; k < N_SWEEP_PARAMETERS; k++) {
+                if (sw->n_values[k] > 0) {
+                        n *= sw->n_values[k];
+                        swept = true;
+                }
+        }
+        return swept ? n : 0;
+}
+
+static void get_parameters(const struct Network *ntw, double *v)
+{
+        v[SWEEP_EXT_CURRENT] = ntw->ext_current;
+        v[SWEEP_G] = ntw->g;
+        v[SWEEP_J] = ntw->J;
+        v[SWEEP_DELAY] = ntw->delay;
+}
+
+static void point_values(const struct Sweep *sw, const double *base, int point, double *v)
+{
+        /* Parameters at a point of the grid. The last parameter varies
+         * fastest; those not swept keep their values in base. */
+        for (int k = N_SWEEP_PARAMETERS - 1; k >= 0; k--) {
+                if (sw->n_values[k] > 0) {
+                        v[k] = sw->values[k][point % sw->n_values[k]];
+                        point /= sw->n_values[k];
+                } else {
+                        v[k] = base[k];
+                }
+        }
+}
+
+static void set_parameters(struct State *S, const double *v)
+{
+        /* Move S to the parameters in v. Only what depends on them is
+         * recomputed: the propagator, and the table of spikes if the delay
+         * spans another number of time steps. */
+        struct Network *ntw = &S->ntw;
+        int lag;
+
+        ntw->ext_current = v[SWEEP_EXT_CURRENT];
+        ntw->g = v[SWEEP_G];
+        ntw->J = v[SWEEP_J];
+        ntw->delay = v[SWEEP_DELAY];
+        set_propagator(S);
+        lag = (int) ceil(ntw->delay / S->sim.DT);
+        if (lag != ntw->tab_spikes.lag) {
+                free_table_of_spikes(&ntw->tab_spikes);
+                initialize_table_of_spikes(ntw, lag);
+        }
+}
+
+static void run_point(struct State *S, double *rate_e, double *rate_i)
+{
+        /* Simulate the current point, write its files and return its mean
+         * rates */
+        double ac[AC_BINS];
+        char filename[MAX_FILENAME_LENGTH];
+
+        open_file_handlers(S);
+        if (S->sim.n_trials > 1) {
+                run_batch(S, rate_e, rate_i);
+        } else {
+                reset(S, 0);
+                open_rate_writer(S);
+                run_trial(S);
+                close_rate_writer(S);
+                save_spike_activity(S);
+                save_final_state(S);
+                average_autocorrelation(S, ac);
+                snprintf(filename, sizeof(filename), "autocorrelation_%s", S->sim.suffix);
+                write_autocorrelation(filename, AC_MAX_LAG, ac, 7);
+                global_autocorrelation(S, ac);
+                snprintf(filename, sizeof(filename), "global_autocorrelation_%s", S->sim.suffix);
+                write_autocorrelation(filename, GLOBAL_AC_MAX_LAG, ac, 6);
+                mean_rates(S, rate_e, rate_i);
+        }
+        fclose(S->sim.spikes_file);
+        fclose(S->sim.pop_rates_file);
+        S->sim.spikes_file = NULL;
+        S->sim.pop_rates_file = NULL;
+}
+
+void run_sweep(struct State *S)
+{
+        /* Simulate all the points of the grid on the network of S, which
+         * must be built */
+        struct Simulation *sim = &S->sim;
+        struct Sweep *sw = &sim->sweep;
+        int n_points = sweep_points(sw);
+        int n_workers = sw->n_workers;
+        struct State *workers;
+        struct PointResult *results;
+        double base[N_SWEEP_PARAMETERS];
+        FILE *f;
+
+        if (n_workers < 1)
+                n_workers = omp_get_num_procs() / sim->n_threads;
+        if (n_workers < 1)
+                n_workers = 1;
+        if (n_workers > n_points)
+                n_workers = n_points;
+        get_parameters(&S->ntw, base);
+        /* The trials of a point run one after another */
+        sim->concurrent_trials = 1;
+        /* Points report when they are done instead */
+        sim->show_progress = false;
+
+        /* Thread 0 runs its points on S itself, the others on clones */
+        workers = emalloc(n_workers * sizeof(struct State));
+        results = emalloc(n_points * sizeof(struct PointResult));
+        for (int t = 1; t < n_workers; t++)
+                clone_state(&workers[t], S);
+        if (n_workers > 1 && sim->n_threads > 1)
+                omp_set_max_active_levels(2);
+        report("Sweeping %d points, %d at a time.\n", n_points, n_workers);
+
+#pragma omp parallel num_threads(n_workers)
+        {
+                int t = omp_get_thread_num();
+                struct State *P = t == 0 ? S : &workers[t];
+                struct PointResult *r;
+
+#pragma omp for schedule(dynamic, 1)
+                for (int k = 0; k < n_points; k++) {
+                        r = &results[k];
+                        point_values(sw, base, k, r->value);
+                        set_parameters(P, r->value);
+                        run_point(P, &r->rate_e, &r->rate_i);
+#pragma omp critical
+                        report("Point %d of %d done (%s): % 7.3f Hz (E), % 7.3f Hz (I)\n",
+                                        k + 1, n_points, P->sim.suffix, r->rate_e, r->rate_i);
+                }
+        }
+
+        if ((f = fopen("sweep_rates.dat", "w")) == NULL)
+                eprintf("cannot open 'sweep_rates.dat':");
+        fprintf(f, "#    ext_I         g         J     delay    rate E    rate I (Hz)\n");
+        for (int k = 0; k < n_points; k++) {
+                for (int j = 0; j < N_SWEEP_PARAMETERS; j++)
+                        fprintf(f, "% 9.4g ", results[k].value[j]);
+                fprintf(f, "% 9.3f % 9.3f\n", results[k].rate_e, results[k].rate_i);
+        }
+        fclose(f);
+
+        for (int t = 1; t < n_workers; t++)
+                free_state(&workers[t]);
+        free(workers);
+        free(results);
+}
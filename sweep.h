@@ -0,0 +1,10 @@
+#ifndef _SWEEP_H
+#define _SWEEP_H 1
+
+#include "simulation.h"
+
+/* sweep.c */
+int parse_sweep_values(const char *s, double *v, int max);
+int sweep_points(const struct Sweep *sw);
+void run_sweep(struct State *S);
+#endif
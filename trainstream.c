@@ -0,0 +1,177 @@
+/* Spike history streamed to disk during the run.
+ *
+ * The history of the analyzed neurons (see keeps_train) grows with the
+ * simulated time. With streaming on, it never holds more than one chunk of
+ * HISTORY_CHUNK spikes in memory: when the chunk is full, it is appended to
+ * a temporary file and the history starts over in the same chunk. The
+ * resident memory then stays the same however long the run.
+ *
+ * The history is not read back into memory at the end either.
+ * sort_streamed_history sorts the file by neuron into a second one, laid
+ * out as the times of a spike archive, reading the first one chunk by
+ * chunk and writing every train TRAIN_BLOCK spikes at a time; only the
+ * index of the trains (first) is kept in the history. The analyses and the
+ * archive then read the trains through a TrainReader, which reads them
+ * from that file, one block at a time, or in place from memory in runs
+ * that are not streamed. */
+#include <unistd.h>
+#include "trainstream.h"
+#include "spikearchive.h"
+
+#define TRAIN_BLOCK 512         /* spikes read or written at once per train */
+
+void open_train_stream(struct State *S)
+{
+        /* Start streaming, if asked for */
+        S->sim.train_stream = NULL;
+        S->sim.sorted_trains = NULL;
+        if (!S->sim.stream_trains)
+                return;
+        if ((S->sim.train_stream = tmpfile()) == NULL)
+                eprintf("cannot create a file for the spike trains:");
+}
+
+void stream_history(struct State *S)
+{
+        /* Append the spikes of the history to the file, and empty it */
+        struct SpikeHistory *h = &S->ntw.history;
+        size_t n;
+
+        for (size_t k = 0; k < h->n; k += n) {
+                n = h->n - k < HISTORY_CHUNK ? h->n - k : HISTORY_CHUNK;
+                if (fwrite(h->chunk[k / HISTORY_CHUNK], sizeof(struct SpikeEvent), n,
+                                        S->sim.train_stream) != n)
+                        eprintf("cannot write the spike trains:");
+        }
+        clear_history(h);
+}
+
+static void write_train_block(int fd, uint64_t *at, const double *t, int n)
+{
+        /* Write n spikes of a train at spike *at of the sorted file */
+        size_t size = n * sizeof(double);
+
+        if (pwrite(fd, t, size, (off_t) (*at * sizeof(double))) != (ssize_t) size)
+                eprintf("cannot write the spike trains:");
+        *at += n;
+}
+
+void sort_streamed_history(struct State *S)
+{
+        /* Sort the streamed spikes by neuron into the sorted file, index
+         * them in the history, and close the stream */
+        struct SpikeHistory *h = &S->ntw.history;
+        FILE *f = S->sim.train_stream;
+        struct SpikeEvent *buf;
+        uint64_t *next;
+        double **pending;       /* the block being filled, for each train */
+        int *n_pending;
+        size_t n;
+        int N = S->ntw.N;
+        int fd, id;
+
+        if (f == NULL)
+                return;
+        stream_history(S);
+        buf = emalloc(HISTORY_CHUNK * sizeof(struct SpikeEvent));
+
+        /* Count the spikes of every neuron */
+        for (int i = 0; i <= N; i++)
+                h->first[i] = 0;
+        rewind(f);
+        while ((n = fread(buf, sizeof(struct SpikeEvent), HISTORY_CHUNK, f)) > 0)
+                for (size_t k = 0; k < n; k++)
+                        h->first[buf[k].id + 1]++;
+        if (ferror(f))
+                eprintf("cannot read the spike trains:");
+        for (int i = 0; i < N; i++)
+                h->first[i + 1] += h->first[i];
+
+        /* ... and write them at their place in the sorted file */
+        if ((S->sim.sorted_trains = tmpfile()) == NULL)
+                eprintf("cannot create a file for the spike trains:");
+        fd = fileno(S->sim.sorted_trains);
+        next = emalloc(N * sizeof(uint64_t));
+        memcpy(next, h->first, N * sizeof(uint64_t));
+        pending = emalloc(N * sizeof(double *));
+        n_pending = emalloc(N * sizeof(int));
+        for (int i = 0; i < N; i++) {
+                pending[i] = h->first[i + 1] > h->first[i] ?
+                        emalloc(TRAIN_BLOCK * sizeof(double)) : NULL;
+                n_pending[i] = 0;
+        }
+        rewind(f);
+        while ((n = fread(buf, sizeof(struct SpikeEvent), HISTORY_CHUNK, f)) > 0) {
+                for (size_t k = 0; k < n; k++) {
+                        id = buf[k].id;
+                        pending[id][n_pending[id]++] = buf[k].time;
+                        if (n_pending[id] == TRAIN_BLOCK) {
+                                write_train_block(fd, &next[id], pending[id], TRAIN_BLOCK);
+                                n_pending[id] = 0;
+                        }
+                }
+        }
+        if (ferror(f))
+                eprintf("cannot read the spike trains:");
+        for (int i = 0; i < N; i++) {
+                if (n_pending[i] > 0)
+                        write_train_block(fd, &next[i], pending[i], n_pending[i]);
+                free(pending[i]);
+        }
+        fclose(f);
+        S->sim.train_stream = NULL;
+        free(pending);
+        free(n_pending);
+        free(next);
+        free(buf);
+}
+
+void open_train(struct State *S, int i, struct TrainReader *r)
+{
+        /* Start reading the train of neuron i */
+        struct SpikeHistory *h = &S->ntw.history;
+        struct SpikeArchive a;
+
+        r->k = 0;
+        if (S->sim.sorted_trains == NULL) {
+                spike_trains(S, &a);
+                r->t = archive_train(&a, i, &r->n);
+                r->length = r->n;
+                r->fd = -1;
+                r->block = NULL;
+                return;
+        }
+        r->fd = fileno(S->sim.sorted_trains);
+        r->next = h->first[i];
+        r->end = h->first[i + 1];
+        r->length = r->end - r->next;
+        r->block = emalloc(TRAIN_BLOCK * sizeof(double));
+        r->t = r->block;
+        r->n = 0;
+}
+
+bool next_spike(struct TrainReader *r, double *t)
+{
+        /* Take the next spike of the train; false at its end */
+        size_t size;
+
+        if (r->k == r->n) {
+                if (r->fd < 0 || r->next == r->end)
+                        return false;
+                r->n = r->end - r->next < TRAIN_BLOCK ? r->end - r->next : TRAIN_BLOCK;
+                size = r->n * sizeof(double);
+                if (pread(r->fd, r->block, size, (off_t) (r->next * sizeof(double)))
+                                != (ssize_t) size)
+                        eprintf("cannot read the spike trains:");
+                r->next += r->n;
+                r->k = 0;
+        }
+        *t = r->t[r->k++];
+        return true;
+}
+
+void close_train(struct TrainReader *r)
+{
+        free(r->block);
+        r->block = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef _TRAINSTREAM_H
+#define _TRAINSTREAM_H 1
+
+#include "simulation.h"
+
+/* Reads the spike train of one neuron in order: in place from memory (see
+ * spike_trains), or block by block from the file of a streamed run */
+struct TrainReader {
+        const double *t;        /* spikes at hand: t[k], ..., t[n - 1] */
+        size_t k;
+        size_t n;
+        size_t length;          /* spikes of the whole train */
+        int fd;                 /* -1 if the train is in memory */
+        uint64_t next;          /* first spike of the next block */
+        uint64_t end;
+        double *block;
+};
+
+/* trainstream.c */
+void open_train_stream(struct State *S);
+void stream_history(struct State *S);
+void sort_streamed_history(struct State *S);
+void open_train(struct State *S, int i, struct TrainReader *r);
+bool next_spike(struct TrainReader *r, double *t);
+void close_train(struct TrainReader *r);
+#endif